@@ -0,0 +1,239 @@
+﻿#include "BlockJournal.hpp"
+
+#include <cstring>
+#include <cstddef>
+#include <ctime>
+#include <chrono>
+#include <algorithm>
+#include <stdexcept>
+#include <zlib.h>
+
+#ifdef __linux__
+	#include <arpa/inet.h>
+#elif _WIN32
+	#include <winsock2.h>
+#endif
+
+#include "Map.hpp"
+#include "Utils/Logger.hpp"
+#include "Utils/Utils.hpp"
+
+BlockJournal::BlockJournal() : m_position(0), m_file(nullptr), m_base(0), m_compactPosition(0), m_stopping(false), m_failed(false)
+{
+	static_assert(sizeof(Header) == 16 && sizeof(Record) == 32, "journal structs must match the file format");
+}
+
+BlockJournal::~BlockJournal()
+{
+	Close();
+}
+
+int BlockJournal::Open(const std::string& filename, Map& map, bool replay)
+{
+	Close();
+
+	m_filename = filename;
+
+	m_header = {};
+	m_header.magic = htonl(kMagic);
+	m_header.formatVersion = htonl(kFormatVersion);
+	m_header.x = htons(map.GetXSize());
+	m_header.y = htons(map.GetYSize());
+	m_header.z = htons(map.GetZSize());
+
+	m_committed.clear();
+	m_base = 0;
+	m_pending.clear();
+	m_compactPosition = 0;
+	m_stopping = false;
+	m_failed = false;
+
+	int replayed = 0;
+
+	std::FILE* fp = replay ? std::fopen(filename.c_str(), "rb") : nullptr;
+	if (fp != nullptr) {
+		Header header;
+
+		if (std::fread(&header, sizeof(header), 1, fp) == 1 && std::memcmp(&header, &m_header, sizeof(header)) == 0) {
+			Record record;
+
+			// Stops at the first record a crash left incomplete
+			while (std::fread(&record, sizeof(record), 1, fp) == 1 && ntohl(record.checksum) == GetChecksum(record)) {
+				Position pos((short)ntohs(record.x), (short)ntohs(record.y), (short)ntohs(record.z));
+
+				try {
+					map.SetBlock(pos, record.newType);
+				} catch (std::runtime_error const& e) {
+					LOG(LogLevel::kWarning, "Skipping block change in %s: %s", filename.c_str(), e.what());
+					continue;
+				}
+
+				m_committed.push_back(record);
+				replayed++;
+			}
+		} else {
+			LOG(LogLevel::kWarning, "Block journal %s doesn't match the map, ignoring it", filename.c_str());
+		}
+
+		std::fclose(fp);
+	}
+
+	// The replayed changes are in the map, a snapshot taken from now on has them
+	m_position = m_committed.size();
+
+	// Written out again so new records don't end up behind a torn one
+	if (!Rewrite()) {
+		LOG(LogLevel::kError, "Can't write block journal %s", filename.c_str());
+
+		if (m_file != nullptr) {
+			std::fclose(m_file);
+			m_file = nullptr;
+		}
+
+		return -1;
+	}
+
+	m_thread = std::thread(&BlockJournal::Run, this);
+
+	if (replayed > 0)
+		LOG(LogLevel::kInfo, "Replayed %d block changes from %s", replayed, filename.c_str());
+
+	return replayed;
+}
+
+void BlockJournal::Close()
+{
+	if (!m_thread.joinable())
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stopping = true;
+	}
+
+	m_condition.notify_one();
+
+	// Commits whatever is still pending first
+	m_thread.join();
+
+	if (m_file != nullptr) {
+		std::fclose(m_file);
+		m_file = nullptr;
+	}
+}
+
+void BlockJournal::Append(const Position& pos, uint8_t oldType, uint8_t newType, const std::string& player)
+{
+	Record record = {};
+	record.x = htons(pos.x);
+	record.y = htons(pos.y);
+	record.z = htons(pos.z);
+	record.oldType = oldType;
+	record.newType = newType;
+	record.time = htonl((uint32_t)std::time(nullptr));
+	std::strncpy(record.player, player.c_str(), kPlayerNameSize);
+	record.checksum = htonl(GetChecksum(record));
+
+	m_position++;
+
+	bool wake;
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		wake = m_pending.empty();
+		m_pending.push_back(record);
+	}
+
+	// The writer is already counting down to the next commit otherwise
+	if (wake)
+		m_condition.notify_one();
+}
+
+void BlockJournal::Compact(uint64_t position)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_compactPosition = std::max(m_compactPosition, position);
+	}
+
+	m_condition.notify_one();
+}
+
+void BlockJournal::Run()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	while (true) {
+		m_condition.wait(lock, [this] { return m_stopping || !m_pending.empty() || m_compactPosition > m_base; });
+
+		// Changes made meanwhile go out with the same fsync
+		if (!m_stopping)
+			m_condition.wait_for(lock, std::chrono::milliseconds(kCommitInterval), [this] { return m_stopping; });
+
+		std::vector<Record> records;
+		records.swap(m_pending);
+
+		// Read together with the records, everything before the position is in this batch or an earlier one
+		uint64_t compactPosition = m_compactPosition;
+		bool stopping = m_stopping;
+
+		lock.unlock();
+
+		if (!records.empty() && !Commit(records))
+			m_failed = true;
+
+		if (compactPosition > m_base) {
+			size_t count = (size_t)std::min<uint64_t>(compactPosition - m_base, m_committed.size());
+
+			m_committed.erase(m_committed.begin(), m_committed.begin() + count);
+			m_base = compactPosition;
+
+			// A journal that couldn't be replaced still has every change, it's only longer
+			if (!Rewrite())
+				m_failed = true;
+		}
+
+		lock.lock();
+
+		if (stopping && m_pending.empty())
+			break;
+	}
+}
+
+bool BlockJournal::Commit(const std::vector<Record>& records)
+{
+	m_committed.insert(m_committed.end(), records.begin(), records.end());
+
+	if (m_file == nullptr)
+		return false;
+
+	if (std::fwrite(records.data(), sizeof(Record), records.size(), m_file) != records.size())
+		return false;
+
+	return Utils::SyncFile(m_file);
+}
+
+// Replaces the file with one holding just the header and m_committed, then goes on appending to it
+bool BlockJournal::Rewrite()
+{
+	if (m_file != nullptr) {
+		std::fclose(m_file);
+		m_file = nullptr;
+	}
+
+	bool ok = Utils::WriteFileAtomically(m_filename, [this](std::FILE* fp) {
+		if (std::fwrite(&m_header, sizeof(m_header), 1, fp) != 1)
+			return false;
+
+		return m_committed.empty() || std::fwrite(m_committed.data(), sizeof(Record), m_committed.size(), fp) == m_committed.size();
+	});
+
+	m_file = std::fopen(m_filename.c_str(), "ab");
+
+	return ok && m_file != nullptr;
+}
+
+uint32_t BlockJournal::GetChecksum(const Record& record)
+{
+	return (uint32_t)crc32(0, (const Bytef*)&record, offsetof(Record, checksum));
+}
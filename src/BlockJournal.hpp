@@ -0,0 +1,90 @@
+﻿#ifndef BLOCKJOURNAL_H_
+#define BLOCKJOURNAL_H_
+
+#include <cstdint>
+#include <cstdio>
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+#include "Position.hpp"
+
+class Map;
+
+// Append-only log of the block changes made since the map was last saved. A writer thread commits them in groups,
+// one fsync every kCommitInterval, so edits are durable long before the next full save. Loading the world replays
+// the log over the saved map; records the map already contains just set the same block again.
+class BlockJournal {
+public:
+	BlockJournal();
+
+	~BlockJournal();
+
+	// Replays the file onto the map first if replay is set, otherwise starts it over. Returns the number of
+	// changes replayed, or -1 if the journal couldn't be written.
+	int Open(const std::string& filename, Map& map, bool replay);
+	void Close();
+
+	bool IsOpen() const { return m_thread.joinable(); }
+
+	// Game thread side
+	void Append(const Position& pos, uint8_t oldType, uint8_t newType, const std::string& player);
+	// Changes appended so far, a map snapshot taken now contains all of them
+	uint64_t GetPosition() const { return m_position; }
+	// Drops the changes before position once a snapshot taken there is saved
+	void Compact(uint64_t position);
+	// True once each time the writer thread failed to write or sync the file
+	bool PollFailure() { return m_failed.exchange(false); }
+
+private:
+	enum { kMagic = 0x4d43424a /* MCBJ */, kFormatVersion = 1 };
+	enum { kCommitInterval = 200 /* milliseconds */, kPlayerNameSize = 16 };
+
+	// Big-endian on disk
+	struct Header {
+		uint32_t magic;
+		uint32_t formatVersion;
+		int16_t x, y, z; // Map size
+		uint16_t padding;
+	};
+
+	struct Record {
+		int16_t x, y, z;
+		uint8_t oldType, newType;
+		uint32_t time; // Unix time
+		char player[kPlayerNameSize]; // Not terminated if the name is 16 characters long
+		uint32_t checksum; // CRC32 of the fields above, a record torn by a crash doesn't match
+	};
+
+	std::string m_filename;
+	Header m_header;
+	uint64_t m_position;
+
+	// Writer thread only once it's started
+	std::FILE* m_file;
+	std::vector<Record> m_committed; // Everything in the file, kept for compaction
+	uint64_t m_base; // Position of the first record in the file
+
+	std::thread m_thread;
+	std::mutex m_mutex;
+	std::condition_variable m_condition;
+
+	// Guarded by m_mutex
+	std::vector<Record> m_pending;
+	uint64_t m_compactPosition;
+	bool m_stopping;
+
+	std::atomic<bool> m_failed;
+
+	void Run();
+	bool Commit(const std::vector<Record>& records);
+	bool Rewrite();
+
+	static uint32_t GetChecksum(const Record& record);
+};
+
+#endif // BLOCKJOURNAL_H_
@@ -0,0 +1,103 @@
+﻿#include "Chunk.hpp"
+
+#include <cstring>
+#include <array>
+#include <algorithm>
+
+Chunk::Chunk(uint8_t type) : m_palette(1, type), m_bits(0)
+{
+}
+
+SharedChunk Chunk::Build(const uint8_t* blocks)
+{
+	std::array<int16_t, 256> lookup;
+	lookup.fill(-1);
+
+	std::vector<uint8_t> palette;
+
+	for (int i = 0; i < kVolume; ++i) {
+		if (lookup[blocks[i]] < 0) {
+			lookup[blocks[i]] = (int16_t)palette.size();
+			palette.push_back(blocks[i]);
+		}
+	}
+
+	if (palette.size() == 1)
+		return GetUniform(palette[0]);
+
+	int bits = 1;
+	while ((size_t)(1 << bits) < palette.size())
+		bits <<= 1;
+
+	auto chunk = std::make_shared<Chunk>(palette[0]);
+	chunk->m_palette = palette;
+	chunk->m_bits = bits;
+	chunk->m_data.assign(kVolume * bits / 8, 0);
+
+	for (int i = 0; i < kVolume; ++i) {
+		int bit = i * bits;
+		chunk->m_data[bit >> 3] |= (uint8_t)(lookup[blocks[i]] << (bit & 7));
+	}
+
+	return chunk;
+}
+
+// Never changed in place, SetBlock() copies a chunk that's shared before writing to it
+SharedChunk Chunk::GetUniform(uint8_t type)
+{
+	static std::array<SharedChunk, 256> uniform;
+
+	if (uniform[type] == nullptr)
+		uniform[type] = std::make_shared<Chunk>(type);
+
+	return uniform[type];
+}
+
+void Chunk::Set(int index, uint8_t type)
+{
+	size_t value = std::find(m_palette.begin(), m_palette.end(), type) - m_palette.begin();
+
+	if (value == m_palette.size()) {
+		m_palette.push_back(type);
+
+		// Unused palette entries aren't reclaimed, the chunk is rebuilt tightly the next time the map is loaded
+		if (m_palette.size() > (size_t)(1 << m_bits))
+			Repack(m_bits == 0 ? 1 : m_bits << 1);
+	}
+
+	int bit = index * m_bits;
+	uint8_t mask = (uint8_t)(((1 << m_bits) - 1) << (bit & 7));
+
+	m_data[bit >> 3] = (uint8_t)((m_data[bit >> 3] & ~mask) | (value << (bit & 7)));
+}
+
+void Chunk::GetRun(int index, int count, uint8_t* out) const
+{
+	if (m_bits == 0) {
+		std::memset(out, m_palette[0], count);
+		return;
+	}
+
+	for (int i = 0; i < count; ++i)
+		out[i] = Get(index + i);
+}
+
+void Chunk::Repack(int bits)
+{
+	std::vector<uint8_t> data(kVolume * bits / 8, 0);
+
+	// Every index is 0 while the chunk is uniform
+	if (m_bits > 0) {
+		int mask = (1 << m_bits) - 1;
+
+		for (int i = 0; i < kVolume; ++i) {
+			int value = (m_data[(i * m_bits) >> 3] >> ((i * m_bits) & 7)) & mask;
+			int bit = i * bits;
+
+			data[bit >> 3] |= (uint8_t)(value << (bit & 7));
+		}
+	}
+
+	m_data.swap(data);
+	m_bits = bits;
+}
@@ -0,0 +1,51 @@
+﻿#ifndef CHUNK_H_
+#define CHUNK_H_
+
+#include <cstdint>
+#include <cstddef>
+
+#include <vector>
+#include <memory>
+
+// 16x16x16 blocks stored as 1, 2, 4 or 8 bit indexes into a palette of the types that occur in the chunk.
+// A chunk of a single type has no indexes at all, one instance per type is shared by every map.
+class Chunk {
+public:
+	enum { kSizeBits = 4, kSize = 1 << kSizeBits, kVolume = kSize * kSize * kSize };
+
+	explicit Chunk(uint8_t type);
+
+	// Blocks in the same y, z, x order as the flat map
+	static std::shared_ptr<Chunk> Build(const uint8_t* blocks);
+	static std::shared_ptr<Chunk> GetUniform(uint8_t type);
+
+	static int GetIndex(int x, int y, int z) { return (((y << kSizeBits) | z) << kSizeBits) | x; }
+
+	uint8_t Get(int index) const
+	{
+		if (m_bits == 0)
+			return m_palette[0];
+
+		int bit = index * m_bits;
+		return m_palette[(m_data[bit >> 3] >> (bit & 7)) & ((1 << m_bits) - 1)];
+	}
+
+	void Set(int index, uint8_t type);
+
+	// Decodes count consecutive blocks starting at index
+	void GetRun(int index, int count, uint8_t* out) const;
+
+	bool IsUniform() const { return m_bits == 0; }
+	size_t GetMemoryUsage() const { return sizeof(Chunk) + m_palette.capacity() + m_data.capacity(); }
+
+private:
+	std::vector<uint8_t> m_palette;
+	std::vector<uint8_t> m_data; // Packed indexes, empty while the chunk is uniform
+	int m_bits;
+
+	void Repack(int bits);
+};
+
+typedef std::shared_ptr<Chunk> SharedChunk;
+
+#endif // CHUNK_H_
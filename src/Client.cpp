@@ -1,22 +1,42 @@
 ﻿#include "Client.hpp"
 #include "World.hpp"
+#include "Network/Protocol.hpp"
+
+#include <cstdint>
+#include <algorithm>
+
+#ifdef __linux__
+	#include <sys/socket.h>
+	#include <sys/uio.h>
+	#include <sys/sendfile.h>
+	#include <unistd.h>
+	#include <cerrno>
+#endif
 
 #include "Utils/Logger.hpp"
+#include "Utils/Metrics.hpp"
 
 uint8_t Client::pid = 0;
+size_t Client::m_queueLimit = Client::kDefaultQueueLimit;
 
-Client::Client() : m_pid(pid++), m_world(nullptr), m_userType(0), m_yaw(0), m_pitch(0), m_chatMuteTime(0)
+Client::Client() : m_pid(pid++), m_world(nullptr), m_userType(0), m_yaw(0), m_pitch(0), m_moved(false), m_queueOffset(0), m_queuedBytes(0), m_backpressure(kBackpressureNone), m_tooSlow(false), m_loading(false), m_mapOffset(0), m_fileFd(-1), m_fileOffset(0), m_fileEnd(0), m_chatMuteTime(0)
 {
 	active = false;
 	authed = false;
+	readable = false;
+	writable = true;
+	ready = false;
+	sendTokens = 0;
 }
 
 Client::~Client()
 {
-	delete stream.socket;
+#ifdef __linux__
+	if (m_fileFd >= 0)
+		close(m_fileFd);
+#endif
 
-	for (auto& obj : m_packetQueue)
-		delete obj;
+	delete stream.socket;
 }
 
 // Checks if player is an operator or if the world allows building
@@ -61,37 +81,632 @@ bool Client::IsChatMuted()
 	return m_chatMuteTime > 0;
 }
 
-void Client::QueuePacket(Packet* packet)
+Client::Lane Client::GetLane(const SharedPacket& packet)
+{
+	switch ((uint8_t)packet->GetBufferPtr()[0]) {
+	case Protocol::PacketType::kServerBlock:
+		return kLaneBlock;
+	case Protocol::PacketType::kServerMessage:
+		return kLaneChat;
+	case Protocol::PacketType::kServerTeleport:
+	case Protocol::PacketType::kServerPositionOrientationChange:
+	case Protocol::PacketType::kServerPositionChange:
+	case Protocol::PacketType::kServerDirection:
+		return kLaneMovement;
+	default:
+		return kLaneControl;
+	}
+}
+
+// LevelData isn't counted towards the queue limit. It's normally kept to kMapStreamWindow packets, but a world change
+// queues the rest of the map at once and that shouldn't count as the client falling behind.
+size_t Client::GetQueuedLength(const SharedPacket& packet)
+{
+	if ((uint8_t)packet->GetBufferPtr()[0] == Protocol::PacketType::kServerLevelData)
+		return 0;
+
+	return packet->GetLength();
+}
+
+void Client::QueueInLane(const SharedPacket& packet)
+{
+	Lane lane = GetLane(packet);
+
+	if (lane == kLaneMovement) {
+		m_movementLane.push_back({ packet, (uint8_t)packet->GetBufferPtr()[1], false, EntityState() });
+		return;
+	}
+
+	uint8_t opcode = (uint8_t)packet->GetBufferPtr()[0];
+
+	// Spawns and despawns overtake movement, so unsent movement for that player is dropped;
+	// the observer's entity state already matches what the spawn or despawn tells it
+	if (opcode == Protocol::PacketType::kServerSpawn || opcode == Protocol::PacketType::kServerDespawn) {
+		uint8_t pid = (uint8_t)packet->GetBufferPtr()[1];
+
+		auto it = m_movementLane.begin();
+		while (it != m_movementLane.end()) {
+			if (it->pid == pid) {
+				m_queuedBytes -= it->packet->GetLength();
+				it = m_movementLane.erase(it);
+			} else {
+				++it;
+			}
+		}
+	}
+
+	if (lane == kLaneBlock && m_backpressure == kBackpressureCoalesceBlocks) {
+		CoalesceBlock(packet);
+		return;
+	}
+
+	m_lanes[lane].push_back(packet);
+}
+
+// Backlogged clients first lose movement, then get block changes as a resend of the affected blocks, then get kicked
+void Client::UpdateBackpressure()
+{
+	if (m_tooSlow)
+		return;
+
+	size_t queued = m_queuedBytes + m_coalescedBlocks.size() * kBlockPacketSize;
+
+	if (queued > m_queueLimit) {
+		m_tooSlow = true;
+
+		// Freed now rather than when the kick goes through
+		for (auto& lane : m_lanes)
+			lane.clear();
+
+		m_movementLane.clear();
+		m_heldPackets.clear();
+		m_coalescedBlocks.clear();
+
+		Metrics::GetMetrics()->Add("backpressure_kicks", 1);
+		return;
+	}
+
+	if (queued >= m_queueLimit / 2 && m_backpressure < kBackpressureCoalesceBlocks) {
+		if (m_backpressure < kBackpressureDropMovement)
+			DropMovement();
+
+		m_backpressure = kBackpressureCoalesceBlocks;
+
+		std::deque<SharedPacket> blocks;
+		blocks.swap(m_lanes[kLaneBlock]);
+
+		for (auto& packet : blocks)
+			CoalesceBlock(packet);
+
+		auto held = m_heldPackets.begin();
+		while (held != m_heldPackets.end()) {
+			if (GetLane(*held) == kLaneBlock) {
+				CoalesceBlock(*held);
+				held = m_heldPackets.erase(held);
+			} else {
+				++held;
+			}
+		}
+	} else if (queued >= m_queueLimit / 4 && m_backpressure < kBackpressureDropMovement) {
+		m_backpressure = kBackpressureDropMovement;
+
+		DropMovement();
+	} else if (queued < m_queueLimit / 8 && m_backpressure != kBackpressureNone) {
+		m_backpressure = kBackpressureNone;
+
+		ResendCoalescedBlocks();
+	}
+}
+
+// Observers of dropped movement get a teleport with the next update instead of a relative move
+void Client::DropMovement()
+{
+	int64_t dropped = 0;
+
+	auto it = m_movementLane.begin();
+	while (it != m_movementLane.end()) {
+		// Self teleports can't be resent, they're kept
+		if (it->pid == 0xFF) {
+			++it;
+			continue;
+		}
+
+		m_entityStates[it->pid].valid = false;
+		m_queuedBytes -= it->packet->GetLength();
+		it = m_movementLane.erase(it);
+		dropped++;
+	}
+
+	// Held packets count towards the limit just the same
+	auto held = m_heldPackets.begin();
+	while (held != m_heldPackets.end()) {
+		if (GetLane(*held) != kLaneMovement || (uint8_t)(*held)->GetBufferPtr()[1] == 0xFF) {
+			++held;
+			continue;
+		}
+
+		m_entityStates[(uint8_t)(*held)->GetBufferPtr()[1]].valid = false;
+		m_queuedBytes -= (*held)->GetLength();
+		held = m_heldPackets.erase(held);
+		dropped++;
+	}
+
+	Metrics::GetMetrics()->Add("backpressure_movement_dropped", dropped);
+}
+
+void Client::CoalesceBlock(const SharedPacket& packet)
+{
+	const uint8_t* data = (const uint8_t*)packet->GetBufferPtr();
+
+	uint64_t x = (data[1] << 8) | data[2];
+	uint64_t y = (data[3] << 8) | data[4];
+	uint64_t z = (data[5] << 8) | data[6];
+
+	m_coalescedBlocks.insert((x << 32) | (y << 16) | z);
+	m_queuedBytes -= packet->GetLength();
+
+	Metrics::GetMetrics()->Add("backpressure_blocks_coalesced", 1);
+}
+
+// Sends the blocks as they are now, however many times they changed in between
+void Client::ResendCoalescedBlocks()
+{
+	if (m_coalescedBlocks.empty())
+		return;
+
+	std::set<uint64_t> blocks;
+	blocks.swap(m_coalescedBlocks);
+
+	if (m_world == nullptr)
+		return;
+
+	Map& map = m_world->GetMap();
+
+	for (uint64_t key : blocks) {
+		Position pos((int16_t)(key >> 32), (int16_t)((key >> 16) & 0xFFFF), (int16_t)(key & 0xFFFF));
+		QueuePacket(Protocol::make_block_packet(pos, map.GetBlockType(pos.x, pos.y, pos.z)));
+	}
+
+	Metrics::GetMetrics()->Add("backpressure_blocks_resent", (int64_t)blocks.size());
+}
+
+void Client::DropCoalescedBlocks()
+{
+	m_coalescedBlocks.clear();
+}
+
+void Client::CommitLanes()
+{
+	CommitControlLane();
+
+	for (int lane = kLaneBlock; lane < kNumLanes; ++lane) {
+		if (lane == kLaneMovement) {
+			for (auto& entry : m_movementLane)
+				m_packetQueue.push_back(entry.packet);
+
+			m_movementLane.clear();
+			continue;
+		}
+
+		m_packetQueue.insert(m_packetQueue.end(), m_lanes[lane].begin(), m_lanes[lane].end());
+		m_lanes[lane].clear();
+	}
+}
+
+void Client::QueuePacket(const SharedPacket& packet)
+{
+	if (m_tooSlow)
+		return;
+
+	m_queuedBytes += packet->GetLength();
+
+	if (!m_loading)
+		QueueInLane(packet);
+	else if (GetLane(packet) == kLaneBlock && m_backpressure == kBackpressureCoalesceBlocks)
+		CoalesceBlock(packet);
+	else
+		m_heldPackets.push_back(packet);
+
+	UpdateBackpressure();
+}
+
+void Client::QueueUrgentPacket(const SharedPacket& packet)
+{
+	m_queuedBytes += packet->GetLength();
+
+	m_lanes[kLaneControl].push_back(packet);
+}
+
+bool Client::QueueMovement(uint8_t pid, const SharedPacket& packet, const EntityState& from, const EntityState& to)
+{
+	if (m_tooSlow)
+		return false;
+
+	if (m_backpressure >= kBackpressureDropMovement) {
+		m_entityStates[pid].valid = false;
+		Metrics::GetMetrics()->Add("backpressure_movement_dropped", 1);
+		return false;
+	}
+
+	if (m_loading) {
+		m_queuedBytes += packet->GetLength();
+		m_heldPackets.push_back(packet);
+		m_entityStates[pid] = to;
+		UpdateBackpressure();
+		return true;
+	}
+
+	for (auto it = m_movementLane.rbegin(); it != m_movementLane.rend(); ++it) {
+		if (it->pid != pid)
+			continue;
+
+		// Older update never left, one packet from its starting state covers both
+		if (it->replaceable) {
+			m_queuedBytes -= it->packet->GetLength();
+			it->packet = Protocol::make_movement_packet(pid, it->from, to.pos, to.yaw, to.pitch);
+			m_queuedBytes += it->packet->GetLength();
+			m_entityStates[pid] = to;
+			Metrics::GetMetrics()->Add("movement_packets_replaced", 1);
+			return true;
+		}
+
+		break;
+	}
+
+	// from may be the entity state itself, it's copied into the lane first
+	m_movementLane.push_back({ packet, pid, true, from });
+	m_queuedBytes += packet->GetLength();
+	m_entityStates[pid] = to;
+
+	// May drop the packet again right away, DropMovement() invalidates the state then
+	UpdateBackpressure();
+
+	return true;
+}
+
+bool Client::HasQueuedPackets() const
+{
+	if (!m_packetQueue.empty() || !m_movementLane.empty() || m_mapStream != nullptr)
+		return true;
+
+	for (auto& lane : m_lanes) {
+		if (!lane.empty())
+			return true;
+	}
+
+	return false;
+}
+
+// Commits more packets to the send queue once it's empty: control first, then map data, then the other lanes by priority
+void Client::FillPacketQueue()
 {
-	m_packetQueue.push_back(packet);
+	if (!m_packetQueue.empty())
+		return;
+
+	std::deque<SharedPacket>& control = m_lanes[kLaneControl];
+	while (!control.empty() && m_packetQueue.size() < kMaxPacketsPerSend) {
+		m_packetQueue.push_back(control.front());
+		control.pop_front();
+	}
+
+	if (!m_packetQueue.empty())
+		return;
+
+	PumpMapStream(kMapStreamWindow);
+
+	if (!m_packetQueue.empty())
+		return;
+
+	for (int lane = kLaneBlock; lane < kNumLanes && m_packetQueue.size() < kMaxPacketsPerSend; ++lane) {
+		if (lane == kLaneMovement) {
+			while (!m_movementLane.empty() && m_packetQueue.size() < kMaxPacketsPerSend) {
+				m_packetQueue.push_back(m_movementLane.front().packet);
+				m_movementLane.pop_front();
+			}
+
+			continue;
+		}
+
+		std::deque<SharedPacket>& queue = m_lanes[lane];
+		while (!queue.empty() && m_packetQueue.size() < kMaxPacketsPerSend) {
+			m_packetQueue.push_back(queue.front());
+			queue.pop_front();
+		}
+	}
 }
 
-void Client::ProcessPacketsInQueue()
+// Hands back the held packets so the caller can queue them after the level data
+std::deque<SharedPacket> Client::StopLoading()
 {
-	auto it = m_packetQueue.begin();
-	while (it != m_packetQueue.end()) {
+	std::deque<SharedPacket> held;
+	held.swap(m_heldPackets);
+
+	for (auto& packet : held)
+		m_queuedBytes -= packet->GetLength();
+
+	m_loading = false;
+
+	return held;
+}
+
+void Client::StreamMap(std::shared_ptr<const std::vector<uint8_t>> compressed)
+{
+	m_mapStream = compressed;
+	m_mapOffset = 0;
+	m_loading = true;
+}
+
+void Client::FinishMapStream()
+{
+	if (m_mapStream == nullptr)
+		return;
+
+	CommitControlLane();
+	PumpMapStream(SIZE_MAX);
+}
+
+// LevelInit may still be waiting in the control lane, it has to go before any map data
+void Client::CommitControlLane()
+{
+	std::deque<SharedPacket>& control = m_lanes[kLaneControl];
+
+	m_packetQueue.insert(m_packetQueue.end(), control.begin(), control.end());
+	control.clear();
+}
+
+// Tops the send queue up to window packets, releases the held packets once the whole map is queued
+void Client::PumpMapStream(size_t window)
+{
+	if (m_mapStream == nullptr)
+		return;
+
+	const std::vector<uint8_t>& compBuffer = *m_mapStream;
+	size_t compSize = compBuffer.size();
+
+	while (m_packetQueue.size() < window && m_mapOffset < compSize) {
+		size_t count = std::min<size_t>(1024, compSize - m_mapOffset);
+
+		const uint8_t* data = &compBuffer[m_mapOffset];
+		m_mapOffset += count;
+
+		uint8_t percent = (uint8_t)(((float)m_mapOffset / (float)compSize) * 100.0f);
+
+		m_packetQueue.push_back(Protocol::make_level_data_packet(data, count, percent));
+	}
+
+	if (m_mapOffset < compSize)
+		return;
+
+	m_mapStream.reset();
+	m_loading = false;
+
+	// The lanes only feed the send queue after the map data in it is gone
+	for (auto& packet : m_heldPackets)
+		QueueInLane(packet);
+
+	m_heldPackets.clear();
+}
+
+#ifdef __linux__
+// Returns false if another file is still queued, the caller sends the map from memory instead
+bool Client::StreamFile(int fd, size_t offset, size_t length)
+{
+	if (m_fileFd >= 0)
+		return false;
+
+	// Own descriptor so the world can replace its file while this one is being sent
+	m_fileFd = dup(fd);
+	if (m_fileFd < 0) {
+		LOG(LogLevel::kWarning, "dup() failed for level stream (errno=%d)", errno);
+		return false;
+	}
+
+	m_fileOffset = (int64_t)offset;
+	m_fileEnd = (int64_t)(offset + length);
+
+	CommitControlLane();
+	m_packetQueue.push_back(nullptr);
+
+	return true;
+}
+
+// Returns false while the file isn't completely sent
+bool Client::SendStreamFile(size_t maxBytes, size_t& sentTotal)
+{
+	while (m_fileOffset < m_fileEnd) {
+		if (sentTotal >= maxBytes)
+			return false;
+
+		off_t offset = (off_t)m_fileOffset;
+		size_t count = std::min<size_t>((size_t)(m_fileEnd - m_fileOffset), maxBytes - sentTotal);
+
+		ssize_t sent = sendfile(stream.socket->getHandle(), m_fileFd, &offset, count);
+		if (sent < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				writable = false;
+			else if (errno != EINTR)
+				active = false;
+
+			return false;
+		}
+
+		// File got shorter than its header said
+		if (sent == 0) {
+			active = false;
+			return false;
+		}
+
+		m_fileOffset += sent;
+		sentTotal += (size_t)sent;
+	}
+
+	close(m_fileFd);
+	m_fileFd = -1;
+
+	m_packetQueue.pop_front();
+
+	return true;
+}
+#endif
+
+// Drops packets that were sent completely and advances the cursor into a partially sent one
+void Client::PopSentBytes(size_t sent)
+{
+	while (sent > 0 && !m_packetQueue.empty()) {
+		const SharedPacket& packet = m_packetQueue.front();
+		size_t remaining = packet->GetLength() - m_queueOffset;
+
+		if (sent < remaining) {
+			m_queueOffset += sent;
+			return;
+		}
+
+		sent -= remaining;
+		m_queueOffset = 0;
+		m_queuedBytes -= GetQueuedLength(packet);
+
+		// Last queue holding a broadcast packet frees it here
+		m_packetQueue.pop_front();
+	}
+}
+
+size_t Client::ProcessPacketsInQueue(size_t maxBytes)
+{
+	size_t sentTotal = 0;
+
+	FillPacketQueue();
+
+#ifdef __linux__
+	// Gather many packets per syscall; sendmsg() instead of writev() so a dead peer can't raise SIGPIPE
+	while (!m_packetQueue.empty() && sentTotal < maxBytes) {
+		if (m_packetQueue.front() == nullptr) {
+			if (!SendStreamFile(maxBytes, sentTotal))
+				break;
+
+			continue;
+		}
+
+		struct iovec iov[kMaxPacketsPerSend];
+		size_t count = 0;
+		size_t total = 0;
+		size_t limit = maxBytes - sentTotal;
+
+		// Stops at a queued level stream file
+		for (auto it = m_packetQueue.begin(); it != m_packetQueue.end() && *it != nullptr && count < kMaxPacketsPerSend && total < limit; ++it) {
+			size_t offset = (count == 0) ? m_queueOffset : 0;
+
+			iov[count].iov_base = (void*)((*it)->GetBufferPtr() + offset);
+			iov[count].iov_len = std::min<size_t>((*it)->GetLength() - offset, limit - total);
+
+			total += iov[count].iov_len;
+			count++;
+		}
+
+		struct msghdr msg = {};
+		msg.msg_iov = iov;
+		msg.msg_iovlen = count;
+
+		ssize_t sent = sendmsg(stream.socket->getHandle(), &msg, MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				writable = false;
+			else if (errno != EINTR)
+				active = false;
+
+			break;
+		}
+
+		PopSentBytes((size_t)sent);
+		sentTotal += (size_t)sent;
+
+		// Socket buffer is full, wait for the reactor to report it writable again
+		if ((size_t)sent < total) {
+			writable = false;
+			break;
+		}
+
+		FillPacketQueue();
+	}
+#else
+	while (!m_packetQueue.empty() && sentTotal < maxBytes) {
+		const SharedPacket& packet = m_packetQueue.front();
+		size_t count = std::min<size_t>(packet->GetLength() - m_queueOffset, maxBytes - sentTotal);
+
 		// send() may send packet partially and then return NotReady
 		size_t sent = 0;
-		auto status = stream.socket->send((*it)->GetBufferPtr(), (*it)->GetLength(), sent);
+		auto status = stream.socket->send(packet->GetBufferPtr() + m_queueOffset, count, sent);
+
+		PopSentBytes(sent);
+		sentTotal += sent;
 
 		if (status != sf::TcpSocket::Status::Done) {
-			//LOG(DEBUG, "Failed to send packet->%s (sent=%d)", m_name.c_str(), sent);
+			// Socket buffer is full, wait for the reactor to report it writable again
+			if (status == sf::TcpSocket::Status::NotReady || status == sf::TcpSocket::Status::Partial)
+				writable = false;
 
-			if (sent > 0) {
-				// Sent partial packet, get the rest and queue it
-				Packet* p = new Packet();
-				p->Write((*it)->GetBufferPtr() + sent, (*it)->GetLength() - sent);
+			break;
+		}
 
-				// Replace old packet with new partial
-				delete *it;
-				*it = p;
-			}
+		FillPacketQueue();
+	}
+#endif
+
+	// Draining may end backpressure
+	if (sentTotal > 0)
+		UpdateBackpressure();
+
+	return sentTotal;
+}
 
-			break; // No threading yet, so we don't want to process every packet in queue right away
+size_t Client::HandOffPackets(size_t maxBytes)
+{
+	size_t handed = 0;
+
+	FillPacketQueue();
+
+	while (!m_packetQueue.empty() && handed < maxBytes) {
+		IoOutboundItem item;
+		size_t length;
+		bool file = (m_packetQueue.front() == nullptr);
+
+		if (file) {
+			// No more of the file than the allowance covers, like SendStreamFile(); the I/O thread closes it after the last range
+			item.fd = m_fileFd;
+			item.offset = m_fileOffset;
+			item.end = std::min<int64_t>(m_fileEnd, m_fileOffset + (int64_t)(maxBytes - handed));
+			item.closeFd = (item.end == m_fileEnd);
+			length = (size_t)(item.end - item.offset);
+		} else {
+			item.packet = m_packetQueue.front();
+			length = item.packet->GetLength();
+		}
+
+		int64_t end = item.end;
+
+		// Full while the socket is backed up, the rest waits here where backpressure can see it
+		if (!m_ioChannel->outbound.Push(std::move(item)))
+			break;
+
+		handed += length;
+
+		if (file) {
+			m_fileOffset = end;
+
+			if (m_fileOffset < m_fileEnd)
+				break;
+
+			m_fileFd = -1;
+		} else {
+			m_queuedBytes -= GetQueuedLength(m_packetQueue.front());
 		}
 
-		// Packet processed successfully, move on
-		delete *it;
-		it = m_packetQueue.erase(it);
+		m_packetQueue.pop_front();
+
+		FillPacketQueue();
 	}
+
+	if (handed > 0)
+		UpdateBackpressure();
+
+	return handed;
 }
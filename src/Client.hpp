@@ -1,23 +1,41 @@
 ﻿#ifndef CLIENT_H_
 #define CLIENT_H_
 
+#include <cstdint>
 #include <cstring>
 #include <cassert>
 
 #include <string>
+#include <deque>
+#include <array>
+#include <set>
 
 #include "Network/ClientStream.hpp"
 #include "Network/Packet.hpp"
+#include "Network/IoThread.hpp"
 #include "Map.hpp"
 #include "Position.hpp"
 
 class World;
 
+// What a client was last told about another player, movement updates are encoded relative to it
+struct EntityState {
+	Position pos;
+	uint8_t yaw, pitch;
+	bool valid;
+
+	EntityState() : yaw(0), pitch(0), valid(false) {}
+};
+
 class Client {
 public:
 	ClientStream stream;
 	bool active;
 	bool authed;
+	bool readable; // Set by the reactor, cleared once the socket has been read
+	bool writable; // Cleared when the socket stops accepting data, set again by the reactor
+	bool ready; // In the server's list of clients with input to handle
+	int64_t sendTokens; // Bytes the egress scheduler allows this client to send
 	std::string leaveMessage;
 
 	Client();
@@ -36,8 +54,13 @@ public:
 	uint8_t GetYaw() { return m_yaw; }
 	uint8_t GetPitch() { return m_pitch; }
 	World* GetWorld() { return m_world; }
+	EntityState& GetEntityState(uint8_t pid) { return m_entityStates[pid]; }
 
 	bool IsActive() { return active; }
+	bool HasMoved() { return m_moved; }
+	bool IsLoading() { return m_loading; }
+	bool IsDownloadingMap() { return m_loading || m_fileFd >= 0; }
+	bool IsTooSlow() { return m_tooSlow; } // Queue went past the limit, needs to be kicked
 
 	void SetName(std::string name) { m_name = name; }
 	void SetChatName(std::string name) { m_chatName = name; }
@@ -45,15 +68,71 @@ public:
 	void SetUserType(uint8_t userType) { m_userType = userType; }
 	void SetChatMute(int32_t chatMuteTime=0);
 	void SetWorld(World* world) { m_world = world; }
+	void SetMoved(bool moved) { m_moved = moved; }
 
 	bool IsChatMuted();
 
-	void QueuePacket(Packet* packet);
+	void QueuePacket(const SharedPacket& packet);
+	void QueueUrgentPacket(const SharedPacket& packet);
+	// Replaces this player's unsent movement if there is one, re-encoded from the state before it. Updates the
+	// entity state to match; returns false if the packet was dropped, the state is invalid then.
+	bool QueueMovement(uint8_t pid, const SharedPacket& packet, const EntityState& from, const EntityState& to);
+
+	enum { kDefaultQueueLimit = 2 * 1024 * 1024 }; // bytes
+
+	// Bytes a client may have queued before it's kicked, set from the config
+	static void SetQueueLimit(size_t limit) { m_queueLimit = limit; }
+
+	// Coalesced blocks belong to the old map once the client changes worlds
+	void DropCoalescedBlocks();
+	// Commits every lane to the send queue, so nothing queued for the old world arrives after the new one's LevelInit
+	void CommitLanes();
+
+	// While loading a map, queued packets are held back so nothing arrives before the level data
+	void StartLoading() { m_loading = true; }
+	std::deque<SharedPacket> StopLoading();
 
-	void ProcessPacketsInQueue();
+	// LevelData is generated from the shared buffer a few chunks at a time, packets queued meanwhile are held until it's done
+	void StreamMap(std::shared_ptr<const std::vector<uint8_t>> compressed);
+	void FinishMapStream();
+
+#ifdef __linux__
+	// Queues a range of a level stream file, sent with sendfile() once the packets ahead of it are out
+	bool StreamFile(int fd, size_t offset, size_t length);
+#endif
+
+	bool HasQueuedPackets() const;
+
+	// Sends at most maxBytes, returns how many went out
+	size_t ProcessPacketsInQueue(size_t maxBytes=SIZE_MAX);
+
+	// Set when the socket belongs to an I/O thread, packets are handed off to it instead of being sent here
+	void SetIoChannel(std::unique_ptr<IoChannel> channel) { m_ioChannel = std::move(channel); }
+	IoChannel* GetIoChannel() { return m_ioChannel.get(); }
+
+	// Moves at most about maxBytes of packets to the I/O thread, returns how many
+	size_t HandOffPackets(size_t maxBytes=SIZE_MAX);
 
 private:
+	enum { kMaxPacketsPerSend = 64 };
+	enum { kMapStreamWindow = 8 }; // LevelData packets queued ahead of the socket
+	enum { kBlockPacketSize = 8 };
+
+	// Stages reached at a quarter and at half of the queue limit, left again below an eighth
+	enum Backpressure { kBackpressureNone, kBackpressureDropMovement, kBackpressureCoalesceBlocks };
+
+	// Drained in this order once the send queue is empty; anything not listed is control
+	enum Lane { kLaneControl, kLaneBlock, kLaneChat, kLaneMovement, kNumLanes };
+
+	struct MovementEntry {
+		SharedPacket packet;
+		uint8_t pid;
+		bool replaceable;
+		EntityState from; // What the observer knew before this packet
+	};
+
 	static uint8_t pid;
+	static size_t m_queueLimit;
 
 	std::string m_name;
 	std::string m_chatName;
@@ -66,8 +145,50 @@ private:
 	uint8_t m_userType;
 	Position m_position;
 	uint8_t m_yaw, m_pitch;
+	bool m_moved; // Position changed since the world last broadcast it
+
+	std::array<EntityState, 256> m_entityStates; // Indexed by pid
+
+	// Packets committed to the socket in order (map data, level stream file, then whatever was taken from the lanes)
+	std::deque<SharedPacket> m_packetQueue;
+	size_t m_queueOffset; // Bytes of the front packet already sent
+
+	std::array<std::deque<SharedPacket>, kNumLanes> m_lanes; // Movement uses m_movementLane
+	std::deque<MovementEntry> m_movementLane;
+
+	size_t m_queuedBytes; // Everything queued or held except map data, which the server paces itself
+	Backpressure m_backpressure;
+	std::set<uint64_t> m_coalescedBlocks; // Packed x, y, z of blocks to resend
+	bool m_tooSlow;
+
+	bool m_loading;
+	std::deque<SharedPacket> m_heldPackets;
+
+	std::shared_ptr<const std::vector<uint8_t>> m_mapStream;
+	size_t m_mapOffset;
+
+	void PumpMapStream(size_t window);
+
+	// A null entry in the send queue marks where the file goes
+	int m_fileFd;
+	int64_t m_fileOffset;
+	int64_t m_fileEnd;
+
+	bool SendStreamFile(size_t maxBytes, size_t& sentTotal);
+
+	std::unique_ptr<IoChannel> m_ioChannel;
+
+	static Lane GetLane(const SharedPacket& packet);
+	static size_t GetQueuedLength(const SharedPacket& packet);
+	void QueueInLane(const SharedPacket& packet);
+	void FillPacketQueue();
+	void CommitControlLane();
+	void PopSentBytes(size_t sent);
 
-	std::vector<Packet*> m_packetQueue;
+	void UpdateBackpressure();
+	void DropMovement();
+	void CoalesceBlock(const SharedPacket& packet);
+	void ResendCoalescedBlocks();
 
 	sf::Clock m_chatMuteClock;
 	int32_t m_chatMuteTime;
@@ -0,0 +1,44 @@
+﻿#ifndef STATSCOMMAND_H_
+#define STATSCOMMAND_H_
+
+#include <string>
+
+#include "../CommandHandler.hpp"
+#include "../Network/Protocol.hpp"
+#include "../Utils/Metrics.hpp"
+
+class StatsCommand : public Command {
+public:
+	StatsCommand(std::string name) : Command(name) {}
+
+	~StatsCommand() {}
+
+	virtual void Execute(Client* sender, const CommandArgs& args) override
+	{
+		auto& counters = Metrics::GetMetrics()->GetCounters();
+
+		if (counters.empty()) {
+			Protocol::SendMessage(sender, "&eNo stats recorded yet");
+			return;
+		}
+
+		// Optional filter, e.g. /stats movement
+		std::string filter = args.empty() ? "" : args.front();
+
+		for (auto& obj : counters) {
+			if (obj.first.find(filter) == std::string::npos)
+				continue;
+
+			Protocol::SendMessage(sender, "&e" + obj.first + ": &f" + std::to_string(obj.second));
+		}
+	}
+
+	virtual std::string GetDocString() override { return "stats [filter] - shows server performance counters"; }
+	virtual unsigned int GetArgumentAmount() override { return 0; }
+	virtual unsigned int GetPermissionLevel() override { return 1; }
+
+private:
+
+};
+
+#endif // STATSCOMMAND_H_
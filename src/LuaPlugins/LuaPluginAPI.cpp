@@ -125,8 +125,7 @@ void LuaServer::LuaPlaceBlock(Client* client, uint8_t type, short x, short y, sh
 	Map& map = world->GetMap();
 
 	try {
-		Position pos(x, y, z);
-		map.SetBlock(pos, type);
+		world->SetBlock(Position(x, y, z), type, client->GetName());
 		world->SendBlockToClients(type, x, y, z);
 	} catch(std::runtime_error const& e) {
 		LOG(LogLevel::kWarning, "Exception in LuaPlaceBlock: %s", e.what());
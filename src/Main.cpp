@@ -25,15 +25,14 @@ int main()
 
 	bool running = true;
 	while (running) {
-		clock.restart();
-
-		running = server->Tick();
-
-		// Sleep up to 33ms
-		sf::Time time = clock.getElapsedTime();
-		int ms = time.asMilliseconds();
-		if (ms < 33) {
-			sf::sleep(sf::milliseconds(33 - ms));
+		int ms = clock.getElapsedTime().asMilliseconds();
+
+		if (ms >= Server::kTickInterval) {
+			clock.restart();
+			running = server->Tick();
+		} else {
+			// Packets are handled as they arrive until the next tick is due
+			server->ProcessNetwork(Server::kTickInterval - ms);
 		}
 	}
 
@@ -2,24 +2,34 @@
 
 #include <cassert>
 #include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
 #include <zlib.h>
 
 #include "Utils/Logger.hpp"
+#include "Utils/Metrics.hpp"
+#include "Utils/Utils.hpp"
 
 #ifdef __linux__
 	#include <arpa/inet.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <cerrno>
 #elif _WIN32
 	#include <winsock2.h>
 #endif
 
-Map::Map() : m_buffer(nullptr)
+Map::Map() : m_chunksX(0), m_chunksY(0), m_chunksZ(0), m_flatSize(0), m_version(0), m_compressedVersion(0), m_checksum(0), m_checksumVersion(0), m_useMmap(false), m_mapped(nullptr), m_pageSize(kDirtyPageSize)
 {
 	SetDimensions(Position());
 }
 
 Map::~Map()
 {
-	std::free(m_buffer);
+	UnmapFile();
 }
 
 void Map::SetDimensions(const Position& pos)
@@ -42,8 +52,18 @@ void Map::Load()
 // TODO: Use C++ file streams
 void Map::LoadFromFile(std::string filename)
 {
-	delete m_buffer;
+	UnmapFile();
 
+	if (m_useMmap && MapFile(filename)) {
+		ResetSegments();
+
+		m_savedFilename.clear();
+
+		m_version++;
+
+		LOG(LogLevel::kInfo, "Mapped map file %s (%d bytes)", filename.c_str(), (int)m_flatSize);
+		return;
+	}
 
 	std::FILE *fp = std::fopen(filename.c_str(), "rb");
 	if (fp == nullptr) {
@@ -51,24 +71,63 @@ void Map::LoadFromFile(std::string filename)
 		std::exit(1);
 	}
 
+	ResetChunks();
+
 	std::fseek(fp, 0, SEEK_END);
-	m_bufferSize = std::ftell(fp);
-	std::rewind(fp);
+	size_t fileSize = std::ftell(fp);
+	std::fseek(fp, 4, SEEK_SET); // Skip the block count
 
-	m_buffer = (uint8_t*)std::malloc(sizeof(uint8_t) * m_bufferSize);
-	if (m_buffer == nullptr) {
-		LOG(LogLevel::kError, "Couldn't allocate memory for map buffer");
+	if (fileSize != m_flatSize) {
+		LOG(LogLevel::kError, "Map file %s is %d bytes, a %dx%dx%d map needs %d", filename.c_str(), (int)fileSize, m_x, m_y, m_z, (int)m_flatSize);
 		std::exit(1);
 	}
 
-	if (std::fread(m_buffer, sizeof(uint8_t), m_bufferSize, fp) != m_bufferSize) {
-		LOG(LogLevel::kError, "Couldn't read map from file");
-		std::exit(1);
+	// One layer of chunks at a time, the flat map is never in memory as a whole
+	size_t layerSize = (size_t)m_x * m_z;
+	std::vector<uint8_t> slab(layerSize * Chunk::kSize);
+	std::vector<uint8_t> blocks(Chunk::kVolume);
+
+	for (int cy = 0; cy < m_chunksY; ++cy) {
+		int height = std::min<int>(Chunk::kSize, m_y - cy * Chunk::kSize);
+		size_t slabSize = layerSize * height;
+
+		if (std::fread(slab.data(), sizeof(uint8_t), slabSize, fp) != slabSize) {
+			LOG(LogLevel::kError, "Couldn't read map from file");
+			std::exit(1);
+		}
+
+		for (int cz = 0; cz < m_chunksZ; ++cz) {
+			for (int cx = 0; cx < m_chunksX; ++cx) {
+				for (int ly = 0; ly < Chunk::kSize; ++ly) {
+					for (int lz = 0; lz < Chunk::kSize; ++lz) {
+						for (int lx = 0; lx < Chunk::kSize; ++lx) {
+							int x = cx * Chunk::kSize + lx;
+							int z = cz * Chunk::kSize + lz;
+
+							// Chunks on the far edges stick out of the map, that part is air
+							uint8_t type = 0;
+							if (ly < height && x < m_x && z < m_z)
+								type = slab[((size_t)ly * m_z + z) * m_x + x];
+
+							blocks[Chunk::GetIndex(lx, ly, lz)] = type;
+						}
+					}
+				}
+
+				GetChunk(cx, cy, cz) = Chunk::Build(blocks.data());
+			}
+		}
 	}
 
 	std::fclose(fp);
 
-	LOG(LogLevel::kInfo, "Loaded map file %s (%d bytes)", filename.c_str(), m_bufferSize);
+	ResetSegments();
+
+	m_savedFilename = filename;
+
+	m_version++;
+
+	LOG(LogLevel::kInfo, "Loaded map file %s (%d bytes, %d KiB in memory)", filename.c_str(), (int)m_flatSize, (int)(GetMemoryUsage() / 1024));
 }
 
 void Map::GenerateFlatMap(std::string filename, short x, short y, short z)
@@ -77,110 +136,571 @@ void Map::GenerateFlatMap(std::string filename, short x, short y, short z)
 
 	SetDimensions(Position(x, y, z));
 
-	m_bufferSize = x*y*z+4;
-	m_buffer = (uint8_t*)std::malloc(sizeof(uint8_t) * m_bufferSize);
+	UnmapFile();
+	ResetChunks();
+
+	// Not on disk until it's saved
+	m_savedFilename.clear();
+
+	std::vector<uint8_t> blocks(Chunk::kVolume);
+
+	// Dirt up to the middle with a layer of grass on top; everything above is air and stays shared
+	for (int cy = 0; cy < m_chunksY; ++cy) {
+		for (int ly = 0; ly < Chunk::kSize; ++ly) {
+			int blockY = cy * Chunk::kSize + ly;
 
-	std::memset(m_buffer, 0, m_bufferSize);
+			uint8_t type = 0x00;
+			if (blockY < (y/2 - 1))
+				type = 0x03;
+			else if (blockY == (y/2 - 1))
+				type = 0x02;
 
-	int sz = htonl(m_bufferSize-4);
-	std::memcpy(m_buffer, &sz, sizeof(sz));
+			for (int lz = 0; lz < Chunk::kSize; ++lz) {
+				for (int lx = 0; lx < Chunk::kSize; ++lx)
+					blocks[Chunk::GetIndex(lx, ly, lz)] = type;
+			}
+		}
 
-	for (short gen_y = 0; gen_y < y/2; gen_y++) {
-		for (short gen_x = 0; gen_x < x; gen_x++) {
-			for (short gen_z = 0; gen_z < z; gen_z++) {
-				Position pos(gen_x, gen_y, gen_z);
-				if (gen_y < (y/2 - 1))
-					SetBlock(pos, 0x03);
-				else
-					SetBlock(pos, 0x02);
+		for (int cz = 0; cz < m_chunksZ; ++cz) {
+			for (int cx = 0; cx < m_chunksX; ++cx) {
+				// Blocks outside the map on the far edges are air
+				if ((cx + 1) * Chunk::kSize > x || (cz + 1) * Chunk::kSize > z || (cy + 1) * Chunk::kSize > y) {
+					std::vector<uint8_t> edge(blocks);
+
+					for (int ly = 0; ly < Chunk::kSize; ++ly) {
+						for (int lz = 0; lz < Chunk::kSize; ++lz) {
+							for (int lx = 0; lx < Chunk::kSize; ++lx) {
+								if (!IsInBounds(cx * Chunk::kSize + lx, cy * Chunk::kSize + ly, cz * Chunk::kSize + lz))
+									edge[Chunk::GetIndex(lx, ly, lz)] = 0x00;
+							}
+						}
+					}
+
+					GetChunk(cx, cy, cz) = Chunk::Build(edge.data());
+				} else {
+					GetChunk(cx, cy, cz) = Chunk::Build(blocks.data());
+				}
 			}
 		}
 	}
 
+	ResetSegments();
+
+	m_version++;
+
 	LOG(LogLevel::kDebug, "Generated flat map '%s'", m_filename.c_str());
 }
 
 // TODO: Use C++ file streams
 void Map::SaveToFile(std::string filename)
 {
-	std::FILE *fp = std::fopen(filename.c_str(), "wb");
-	if (fp == nullptr) {
-		LOG(LogLevel::kError, "Can't open map file for writing");
-		std::exit(1);
+	SaveJob job = StartSave(filename, false);
+	RunSave(job);
+	FinishSave(job);
+}
+
+Map::SaveJob Map::StartSave(const std::string& filename, bool inPlace)
+{
+	SaveJob job(Position(m_x, m_y, m_z));
+	job.filename = filename;
+	job.flatSize = m_flatSize;
+	job.partial = false;
+	job.ok = false;
+	job.writtenBytes = 0;
+	job.elapsedUs = 0;
+
+	// Rewriting the mapped file would truncate it under the mapping
+	if (m_mapped != nullptr && filename == m_mappedFilename) {
+		job.mapping = m_mapping;
+		job.syncRanges = TakeDirtyPages();
+	} else if (m_mapped != nullptr) {
+		job.flat.assign(m_mapped, m_mapped + m_flatSize);
+	} else {
+		job.chunks = m_chunks;
+		job.syncRanges = TakeDirtyPages();
+
+		// Any other file is written in full, the pages are dirty relative to it from now on
+		job.partial = inPlace && (filename == m_savedFilename);
+		m_savedFilename = filename;
 	}
 
-	if (std::fwrite(m_buffer, sizeof(uint8_t), m_bufferSize, fp) != m_bufferSize) {
-		LOG(LogLevel::kError, "Couldn't write map to file");
-		std::exit(1);
+	return job;
+}
+
+void Map::RunSave(SaveJob& job)
+{
+	auto start = std::chrono::steady_clock::now();
+
+	if (job.mapping != nullptr) {
+		job.ok = SyncPages(job.mapping.get(), job.syncRanges);
+	} else if (job.partial && WritePages(job)) {
+		job.ok = true;
+	} else {
+		// The file is missing or isn't the size it should be, or partial saves aren't supported here
+		job.partial = false;
+		job.ok = WriteFile(job);
 	}
 
-	std::fclose(fp);
+	if (job.ok && (job.mapping != nullptr || job.partial)) {
+		for (auto& range : job.syncRanges)
+			job.writtenBytes += range.second;
+	} else if (job.ok) {
+		job.writtenBytes = job.flatSize;
+	}
 
-	LOG(LogLevel::kDebug, "Saved map file %s (%d bytes)", filename.c_str(), m_bufferSize);
+	job.elapsedUs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
 }
 
-void Map::SetBlock(Position& pos, uint8_t type)
+bool Map::FinishSave(const SaveJob& job)
+{
+	if (!job.ok) {
+		LOG(LogLevel::kError, "Couldn't save map file %s", job.filename.c_str());
+
+		// Synced again by the next save unless the map was reloaded meanwhile
+		if (job.mapping != nullptr && job.mapping == m_mapping) {
+			for (auto& range : job.syncRanges) {
+				for (size_t offset = range.first; offset < range.first + range.second; offset += m_pageSize)
+					m_dirtyPages[offset / m_pageSize] = true;
+			}
+		}
+
+		// Part of the file may have been written, the next save rewrites all of it
+		if (job.mapping == nullptr && job.filename == m_savedFilename)
+			m_savedFilename.clear();
+
+		return false;
+	}
+
+	Metrics::GetMetrics()->Add("map_saves", 1);
+	Metrics::GetMetrics()->Add("map_save_bytes", (int64_t)job.writtenBytes);
+	Metrics::GetMetrics()->Set("map_save_ms", job.elapsedUs / 1000);
+
+	LOG(LogLevel::kDebug, "%s map file %s (%d of %d bytes, %d ms)", (job.mapping != nullptr) ? "Synced" : "Saved", job.filename.c_str(),
+		(int)job.writtenBytes, (int)job.flatSize, (int)(job.elapsedUs / 1000));
+
+	return true;
+}
+
+#ifdef __linux__
+// Writes the changed pages over the file in place. A crash can leave some of them unwritten, the block journal
+// replays those changes on the next load.
+bool Map::WritePages(const SaveJob& job)
+{
+	int fd = open(job.filename.c_str(), O_WRONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	bool ok = fstat(fd, &st) == 0 && (size_t)st.st_size == job.flatSize;
+
+	std::vector<uint8_t> buffer(kFlatBlockSize);
+
+	for (auto& range : job.syncRanges) {
+		for (size_t offset = range.first; ok && offset < range.first + range.second; offset += kFlatBlockSize) {
+			size_t size = std::min<size_t>(kFlatBlockSize, range.first + range.second - offset);
+
+			CopyChunks(job.chunks, job.size, offset, size, buffer.data());
+
+			ok = pwrite(fd, buffer.data(), size, (off_t)offset) == (ssize_t)size;
+		}
+	}
+
+	if (ok)
+		ok = fdatasync(fd) == 0;
+
+	close(fd);
+
+	return ok;
+}
+#else
+bool Map::WritePages(const SaveJob&)
 {
-	int offset = calcMapOffset(pos.x, pos.y, pos.z, m_x, m_z) + 4;
+	return false;
+}
+#endif
 
-	if (offset < 0 || offset >= (int)m_bufferSize)
+bool Map::WriteFile(const SaveJob& job)
+{
+	return Utils::WriteFileAtomically(job.filename, [&job](std::FILE* fp) {
+		std::vector<uint8_t> buffer(kFlatBlockSize);
+
+		for (size_t offset = 0; offset < job.flatSize; offset += kFlatBlockSize) {
+			size_t size = std::min<size_t>(kFlatBlockSize, job.flatSize - offset);
+
+			if (!job.flat.empty())
+				std::memcpy(buffer.data(), &job.flat[offset], size);
+			else
+				CopyChunks(job.chunks, job.size, offset, size, buffer.data());
+
+			if (std::fwrite(buffer.data(), sizeof(uint8_t), size, fp) != size)
+				return false;
+		}
+
+		return true;
+	});
+}
+
+void Map::SetBlock(Position& pos, uint8_t type)
+{
+	if (!IsInBounds(pos.x, pos.y, pos.z))
 		throw std::runtime_error("map->" + m_filename + " | buffer overlow");
 
-	m_buffer[offset] = type;
+	size_t offset = calcMapOffset((size_t)pos.x, (size_t)pos.y, (size_t)pos.z, (size_t)m_x, (size_t)m_z) + 4;
+
+	if (m_mapped != nullptr) {
+		if (m_mapped[offset] == type)
+			return;
+
+		m_mapped[offset] = type;
+		m_version++;
+		m_dirtySegments[offset / Deflate::kSegmentSize] = true;
+		m_dirtyPages[offset / m_pageSize] = true;
+		return;
+	}
+
+	SharedChunk& chunk = GetChunk(pos.x >> Chunk::kSizeBits, pos.y >> Chunk::kSizeBits, pos.z >> Chunk::kSizeBits);
+	int index = Chunk::GetIndex(pos.x & (Chunk::kSize - 1), pos.y & (Chunk::kSize - 1), pos.z & (Chunk::kSize - 1));
+
+	if (chunk->Get(index) == type)
+		return;
+
+	// Uniform chunks are shared by every map, copied before the first change
+	if (chunk.use_count() > 1)
+		chunk = std::make_shared<Chunk>(*chunk);
+
+	chunk->Set(index, type);
+
+	m_version++;
+	m_dirtySegments[offset / Deflate::kSegmentSize] = true;
+	m_dirtyPages[offset / m_pageSize] = true;
 }
 
 // returns 0 if out of bounds
 uint8_t Map::GetBlockType(short x, short y, short z)
 {
-	int offset = calcMapOffset(x, y, z, m_x, m_z) + 4;
-
-	if (offset < 0 || offset >= (int)m_bufferSize)
+	if (!IsInBounds(x, y, z))
 		return 0;
 
-	return m_buffer[offset];
+	if (m_mapped != nullptr)
+		return m_mapped[calcMapOffset((size_t)x, (size_t)y, (size_t)z, (size_t)m_x, (size_t)m_z) + 4];
+
+	const SharedChunk& chunk = GetChunk(x >> Chunk::kSizeBits, y >> Chunk::kSizeBits, z >> Chunk::kSizeBits);
+
+	return chunk->Get(Chunk::GetIndex(x & (Chunk::kSize - 1), y & (Chunk::kSize - 1), z & (Chunk::kSize - 1)));
 }
 
-void Map::CompressBuffer(uint8_t** outCompBuffer, size_t* outCompSize)
+void Map::CopyFlat(size_t offset, size_t size, uint8_t* out) const
 {
-	assert(*outCompBuffer==nullptr && m_buffer != nullptr);
+	if (m_mapped != nullptr) {
+		std::memcpy(out, m_mapped + offset, size);
+		return;
+	}
 
-	*outCompBuffer = (uint8_t*)std::malloc(sizeof(uint8_t) * m_bufferSize);
-	if (*outCompBuffer == nullptr) {
-		LOG(LogLevel::kError, "Couldn't allocate memory for map buffer");
-		std::exit(1);
+	CopyChunks(m_chunks, Position(m_x, m_y, m_z), offset, size, out);
+}
+
+void Map::CopyChunks(const std::vector<SharedChunk>& chunks, const Position& mapSize, size_t offset, size_t size, uint8_t* out)
+{
+	size_t xSize = (size_t)mapSize.x, zSize = (size_t)mapSize.z;
+	size_t chunksX = (xSize + Chunk::kSize - 1) >> Chunk::kSizeBits;
+	size_t chunksZ = (zSize + Chunk::kSize - 1) >> Chunk::kSizeBits;
+
+	// Block count, big-endian
+	uint32_t count = htonl((uint32_t)(xSize * mapSize.y * zSize));
+	while (size > 0 && offset < 4) {
+		*out++ = ((const uint8_t*)&count)[offset++];
+		size--;
+	}
+
+	size_t index = offset - 4;
+
+	// A run ends at the end of a row or of a chunk, whichever comes first
+	while (size > 0) {
+		size_t row = index / xSize;
+		int x = (int)(index % xSize);
+		int z = (int)(row % zSize);
+		int y = (int)(row / zSize);
+
+		int run = std::min<int>((int)xSize - x, Chunk::kSize - (x & (Chunk::kSize - 1)));
+		run = (int)std::min<size_t>(run, size);
+
+		const SharedChunk& chunk = chunks[((y >> Chunk::kSizeBits) * chunksZ + (z >> Chunk::kSizeBits)) * chunksX + (x >> Chunk::kSizeBits)];
+		chunk->GetRun(Chunk::GetIndex(x & (Chunk::kSize - 1), y & (Chunk::kSize - 1), z & (Chunk::kSize - 1)), run, out);
+
+		out += run;
+		index += run;
+		size -= run;
 	}
+}
+
+size_t Map::GetMemoryUsage() const
+{
+	size_t usage = m_chunks.capacity() * sizeof(SharedChunk);
 
-	std::memset(*outCompBuffer, 0, m_bufferSize);
+	// Uniform chunks are shared, they cost nothing per map
+	for (auto& chunk : m_chunks) {
+		if (!chunk->IsUniform())
+			usage += chunk->GetMemoryUsage();
+	}
 
-	z_stream strm;
-	strm.zalloc = Z_NULL;
-	strm.zfree = Z_NULL;
-	strm.opaque = Z_NULL;
-	strm.avail_in = (uLong)m_bufferSize;
-	strm.next_in = (Bytef*)m_buffer;
-	strm.avail_out = 0;
-	strm.next_out = Z_NULL;
+	return usage;
+}
 
-	int ret = deflateInit2(&strm, Z_BEST_COMPRESSION, Z_DEFLATED, (MAX_WBITS + 16), 8, Z_DEFAULT_STRATEGY);
-	if (ret != Z_OK) {
-		LOG(LogLevel::kDebug, "Zlib error: deflateInit2()");
+#ifdef __linux__
+bool Map::MapFile(const std::string& filename)
+{
+	int fd = open(filename.c_str(), O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		LOG(LogLevel::kWarning, "Can't open map file %s for mapping (errno=%d)", filename.c_str(), errno);
+		return false;
+	}
+
+	struct stat st;
+	size_t flatSize = (size_t)m_x * m_y * m_z + 4;
+
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size != flatSize) {
+		LOG(LogLevel::kError, "Map file %s is %d bytes, a %dx%dx%d map needs %d", filename.c_str(), (int)st.st_size, m_x, m_y, m_z, (int)flatSize);
 		std::exit(1);
 	}
 
-	strm.avail_out = (uLong)m_bufferSize;
-	strm.next_out = (Bytef*)(*outCompBuffer);
+	void* addr = mmap(nullptr, flatSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
 
-	ret = deflate(&strm, Z_FINISH);
+	// The mapping keeps the file referenced
+	close(fd);
 
-	switch (ret) {
-		case Z_NEED_DICT:
-		case Z_DATA_ERROR:
-		case Z_MEM_ERROR:
-			LOG(LogLevel::kError, "Zlib error: inflate()");
-			std::exit(1);
+	if (addr == MAP_FAILED) {
+		LOG(LogLevel::kWarning, "mmap() failed for map file %s (errno=%d)", filename.c_str(), errno);
+		return false;
 	}
 
-	deflateEnd(&strm);
+	m_mapping = std::shared_ptr<uint8_t>((uint8_t*)addr, [flatSize](uint8_t* mapping) { munmap(mapping, flatSize); });
+	m_mapped = m_mapping.get();
+	m_mappedFilename = filename;
+	m_flatSize = flatSize;
+	m_pageSize = (size_t)sysconf(_SC_PAGESIZE);
+	m_dirtyPages.assign((flatSize + m_pageSize - 1) / m_pageSize, false);
+
+	m_chunks.clear();
+
+	return true;
+}
+
+bool Map::SyncPages(uint8_t* mapping, const std::vector<std::pair<size_t, size_t>>& ranges)
+{
+	bool ok = true;
+
+	for (auto& range : ranges) {
+		if (msync(mapping + range.first, range.second, MS_SYNC) < 0)
+			ok = false;
+	}
+
+	return ok;
+}
+#else
+bool Map::MapFile(const std::string& filename)
+{
+	LOG(LogLevel::kWarning, "Memory-mapped maps need Linux, loading %s normally", filename.c_str());
+	return false;
+}
+
+bool Map::SyncPages(uint8_t*, const std::vector<std::pair<size_t, size_t>>&)
+{
+	return true;
+}
+#endif
+
+void Map::UnmapFile()
+{
+	if (m_mapped == nullptr)
+		return;
+
+	if (!SyncPages(m_mapped, TakeDirtyPages()))
+		LOG(LogLevel::kWarning, "Couldn't sync map file %s", m_mappedFilename.c_str());
+
+	// A save still syncing holds its own reference, the file is unmapped once it's done
+	m_mapping.reset();
+	m_mapped = nullptr;
+	m_mappedFilename.clear();
+}
+
+// Runs of changed pages as offset and length, the rest of the file doesn't need syncing
+std::vector<std::pair<size_t, size_t>> Map::TakeDirtyPages()
+{
+	std::vector<std::pair<size_t, size_t>> ranges;
+	size_t numPages = m_dirtyPages.size();
+
+	for (size_t page = 0; page < numPages;) {
+		if (!m_dirtyPages[page]) {
+			page++;
+			continue;
+		}
+
+		size_t first = page;
+		while (page < numPages && m_dirtyPages[page]) {
+			m_dirtyPages[page] = false;
+			page++;
+		}
+
+		size_t offset = first * m_pageSize;
+		ranges.push_back(std::make_pair(offset, std::min(page * m_pageSize, m_flatSize) - offset));
+	}
+
+	return ranges;
+}
+
+void Map::ResetChunks()
+{
+	m_chunksX = (m_x + Chunk::kSize - 1) >> Chunk::kSizeBits;
+	m_chunksY = (m_y + Chunk::kSize - 1) >> Chunk::kSizeBits;
+	m_chunksZ = (m_z + Chunk::kSize - 1) >> Chunk::kSizeBits;
+
+	m_chunks.assign((size_t)m_chunksX * m_chunksY * m_chunksZ, Chunk::GetUniform(0x00));
+
+	m_flatSize = (size_t)m_x * m_y * m_z + 4;
+
+	m_pageSize = kDirtyPageSize;
+	m_dirtyPages.assign((m_flatSize + m_pageSize - 1) / m_pageSize, false);
+}
+
+void Map::ResetSegments()
+{
+	m_segments.assign(Deflate::GetNumSegments(m_flatSize), nullptr);
+	m_dirtySegments.assign(m_segments.size(), true);
+}
+
+Map::CompressionJob Map::StartCompression(int level)
+{
+	assert(IsLoaded());
+
+	CompressionJob job(Position(m_x, m_y, m_z));
+	job.version = m_version;
+	job.flatSize = m_flatSize;
+	job.level = level;
+	job.inputBytes = 0;
+	job.outputBytes = 0;
+	job.elapsedUs = 0;
+	job.segments = m_segments;
+
+	// A vector of pointers however big the map is, the mapping changes under the job so it can't be shared
+	if (m_mapped == nullptr)
+		job.chunks = m_chunks;
+
+	size_t numSegments = m_segments.size();
+
+	for (size_t i = 0; i < numSegments; ++i) {
+		if (!m_dirtySegments[i])
+			continue;
+
+		size_t offset = i * Deflate::kSegmentSize;
+		size_t size = std::min<size_t>(Deflate::kSegmentSize, m_flatSize - offset);
+
+		job.dirty.push_back(i);
+		job.inputs.push_back({ std::vector<uint8_t>(), i == numSegments - 1 });
+
+		if (m_mapped != nullptr)
+			job.inputs.back().data.assign(m_mapped + offset, m_mapped + offset + size);
+
+		// Set again by SetBlock if the segment changes before the job is finished
+		m_dirtySegments[i] = false;
+	}
+
+	Metrics::GetMetrics()->Add("map_segments_compressed", (int64_t)job.dirty.size());
+	Metrics::GetMetrics()->Add("map_segments_reused", (int64_t)(numSegments - job.dirty.size()));
+
+	return job;
+}
+
+void Map::RunCompression(CompressionJob& job)
+{
+	auto start = std::chrono::steady_clock::now();
+
+	if (!job.chunks.empty()) {
+		for (size_t i = 0; i < job.dirty.size(); ++i) {
+			size_t offset = job.dirty[i] * Deflate::kSegmentSize;
+			size_t size = std::min<size_t>(Deflate::kSegmentSize, job.flatSize - offset);
+
+			job.inputs[i].data.resize(size);
+			CopyChunks(job.chunks, job.size, offset, size, job.inputs[i].data.data());
+		}
+	}
+
+	std::vector<Deflate::SharedSegment> compressed;
+	Deflate::CompressSegments(job.inputs, job.level, compressed);
+
+	for (size_t i = 0; i < job.dirty.size(); ++i) {
+		job.segments[job.dirty[i]] = compressed[i];
+
+		job.inputBytes += job.inputs[i].data.size();
+		job.outputBytes += compressed[i]->data.size();
+	}
+
+	job.elapsedUs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+	auto compBuffer = std::make_shared<std::vector<uint8_t>>();
+	Deflate::WriteGzip(job.segments, *compBuffer);
+
+	job.result = compBuffer;
+}
+
+void Map::FinishCompression(const CompressionJob& job)
+{
+	// Segments dirtied while the job ran (or by a reload) stay dirty
+	for (size_t i : job.dirty) {
+		if (i < m_segments.size() && !m_dirtySegments[i])
+			m_segments[i] = job.segments[i];
+	}
+
+	// Ratio and throughput only cover the segments this job compressed
+	if (job.inputBytes > 0) {
+		Metrics::GetMetrics()->Set("map_compress_level", job.level);
+		Metrics::GetMetrics()->Set("map_compress_ratio_pct", (int64_t)(job.outputBytes * 100 / job.inputBytes));
+		Metrics::GetMetrics()->Set("map_compress_kb_per_sec", (int64_t)job.inputBytes * 1000 / std::max<int64_t>(1, job.elapsedUs));
+	}
+
+	if (job.version != m_version)
+		return;
+
+	m_compressedBuffer = job.result;
+	m_compressedVersion = job.version;
+
+	LOG(LogLevel::kDebug, "Compressed map %s (version %u, %d of %d segments, level %d, %d ms, %d bytes)", m_filename.c_str(), m_version,
+		(int)job.dirty.size(), (int)m_segments.size(), job.level, (int)(job.elapsedUs / 1000), (int)job.result->size());
+}
+
+std::shared_ptr<const std::vector<uint8_t>> Map::GetCompressedBuffer()
+{
+	if (m_compressedVersion != m_version)
+		return nullptr;
+
+	return m_compressedBuffer;
+}
+
+uint32_t Map::GetChecksum()
+{
+	if (!IsLoaded())
+		return 0;
+
+	if (m_checksumVersion != m_version) {
+		// The gzip trailer already has it whenever the compressed map is current
+		auto compressed = GetCompressedBuffer();
+		if (compressed != nullptr) {
+			m_checksum = Deflate::ReadGzipCrc(*compressed);
+		} else {
+			std::vector<uint8_t> buffer(kFlatBlockSize);
+			uLong crc = crc32(0, Z_NULL, 0);
+
+			for (size_t offset = 0; offset < m_flatSize; offset += kFlatBlockSize) {
+				size_t size = std::min<size_t>(kFlatBlockSize, m_flatSize - offset);
+
+				CopyFlat(offset, size, buffer.data());
+				crc = crc32(crc, buffer.data(), (uInt)size);
+			}
+
+			m_checksum = (uint32_t)crc;
+		}
+
+		m_checksumVersion = m_version;
+	}
 
-	*outCompSize = (size_t)strm.total_out;
+	return m_checksum;
 }
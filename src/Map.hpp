@@ -6,8 +6,12 @@
 #include <cstdint>
 
 #include <string>
+#include <vector>
+#include <memory>
 
 #include "Position.hpp"
+#include "Chunk.hpp"
+#include "Utils/Deflate.hpp"
 
 class Map {
 public:
@@ -15,32 +19,146 @@ public:
 
 	~Map();
 
+	Map(const Map&) = delete;
+	Map& operator=(const Map&) = delete;
+
 	void SetDimensions(const Position& pos);
 	void SetFilename(std::string filename);
 
-	uint8_t* GetBuffer() { return m_buffer; }
-	size_t GetBufferSize() { return m_bufferSize; }
+	bool IsLoaded() { return !m_chunks.empty() || m_mapped != nullptr; }
+	// Size of the map as it's saved and sent: a 4 byte block count followed by the blocks in y, z, x order
+	size_t GetFlatSize() { return m_flatSize; }
+	size_t GetMemoryUsage() const;
 	int16_t& GetXSize() { return m_x; }
 	int16_t& GetYSize() { return m_y; }
 	int16_t& GetZSize() { return m_z; }
 	std::string GetFilename() { return m_filename; }
+	uint32_t GetVersion() { return m_version; }
+	uint32_t GetChecksum(); // CRC32 of the buffer, cached until the map changes
 
 	void GenerateFlatMap(std::string filename, short x, short y, short z);
 
 	void Load();
 	void LoadFromFile(std::string filename);
 
+	// Blocking save of the whole map, see StartSave()
 	void SaveToFile(std::string filename);
 	void SaveToFile() { SaveToFile(m_filename); }
 
+	// The blocks as they were when the save started. Chunks are shared with the map until SetBlock copies them,
+	// so taking one costs a vector of pointers however big the map is.
+	struct SaveJob {
+		std::string filename;
+		size_t flatSize;
+		Position size;
+		std::vector<SharedChunk> chunks;
+		std::vector<uint8_t> flat; // Mapped map saved to another file, its pages can't be shared
+		std::shared_ptr<uint8_t> mapping; // Mapped map saved to its own file, stays mapped until the sync is done
+		std::vector<std::pair<size_t, size_t>> syncRanges; // Offset and length of the pages changed since the last save
+		bool partial; // Only syncRanges need writing, the rest of the file is up to date
+
+		// Filled in by RunSave
+		bool ok;
+		size_t writtenBytes;
+		int64_t elapsedUs;
+
+		SaveJob(const Position& mapSize) : size(mapSize) {}
+	};
+
+	// With inPlace, saving to the file the map was loaded from or last saved to only writes the pages changed
+	// since then, over the file. A crash can leave some of them unwritten, so that's only safe when something
+	// like the block journal can replay them.
+	SaveJob StartSave(const std::string& filename, bool inPlace);
+	// Touches nothing but the job so it can run on a worker thread. Unless the save is in place the file is
+	// written next to the old one, synced and renamed over it, a crash at any point leaves one of the two intact.
+	static void RunSave(SaveJob& job);
+	bool FinishSave(const SaveJob& job);
+
+	// Load() maps the file MAP_SHARED instead of reading it into chunks: pages are read on first touch, edits go
+	// straight to the page cache and saving only syncs the pages that changed. Linux only, ignored elsewhere.
+	void SetMemoryMapped(bool mapped) { m_useMmap = mapped; }
+	bool IsMemoryMapped() const { return m_mapped != nullptr; }
+
 	void SetBlock(Position& pos, uint8_t type);
 	uint8_t GetBlockType(short x, short y, short z);
 
-	void CompressBuffer(uint8_t** outCompBuffer, size_t* outCompSize);
+	// Produces a range of the flat map from the chunks
+	void CopyFlat(size_t offset, size_t size, uint8_t* out) const;
+
+	// Only segments changed since they were last compressed are copied and deflated again. Like a save, the job
+	// shares the chunks and decodes the dirty segments on the worker; a mapped map is copied up front instead.
+	struct CompressionJob {
+		uint32_t version;
+		std::vector<Deflate::SharedSegment> segments; // Null where dirty
+		std::vector<size_t> dirty;
+		std::vector<Deflate::SegmentInput> inputs; // Raw copies of the dirty segments, empty until decoded if chunks are set
+		std::vector<SharedChunk> chunks;
+		Position size;
+		size_t flatSize;
+		int level;
+		std::shared_ptr<const std::vector<uint8_t>> result;
+
+		// Filled in by RunCompression
+		size_t inputBytes, outputBytes;
+		int64_t elapsedUs;
+
+		CompressionJob(const Position& mapSize) : size(mapSize) {}
+	};
+
+	CompressionJob StartCompression(int level);
+	// Touches nothing but the job so it can run on a worker thread
+	static void RunCompression(CompressionJob& job);
+	void FinishCompression(const CompressionJob& job);
+
+	// Gzipped map as sent in LevelData, nullptr if the map changed since it was last compressed
+	std::shared_ptr<const std::vector<uint8_t>> GetCompressedBuffer();
 
 private:
-	uint8_t *m_buffer;
-	size_t m_bufferSize;
+	enum { kFlatBlockSize = 64 * 1024 /* bytes */ }; // Staging buffer for streaming the flat map to and from disk
+
+	std::vector<SharedChunk> m_chunks; // Indexed like blocks, y then z then x; empty while mapped
+	int m_chunksX, m_chunksY, m_chunksZ;
+	size_t m_flatSize;
+
+	uint32_t m_version; // Bumped on every change to the blocks
+
+	std::shared_ptr<const std::vector<uint8_t>> m_compressedBuffer;
+	uint32_t m_compressedVersion;
+
+	uint32_t m_checksum;
+	uint32_t m_checksumVersion;
+
+	std::vector<Deflate::SharedSegment> m_segments;
+	std::vector<bool> m_dirtySegments;
+
+	bool m_useMmap;
+	std::shared_ptr<uint8_t> m_mapping; // Unmapped once the last reference is gone
+	uint8_t* m_mapped; // The whole file, block count included
+	std::string m_mappedFilename;
+
+	enum { kDirtyPageSize = 4096 /* bytes */ };
+
+	// Pages of the flat map changed since m_savedFilename was written, or of the mapping since it was synced
+	std::string m_savedFilename;
+	size_t m_pageSize;
+	std::vector<bool> m_dirtyPages;
+
+	bool MapFile(const std::string& filename);
+	void UnmapFile();
+	std::vector<std::pair<size_t, size_t>> TakeDirtyPages();
+
+	static bool SyncPages(uint8_t* mapping, const std::vector<std::pair<size_t, size_t>>& ranges);
+	static bool WriteFile(const SaveJob& job);
+	static bool WritePages(const SaveJob& job);
+	static void CopyChunks(const std::vector<SharedChunk>& chunks, const Position& size, size_t offset, size_t length, uint8_t* out);
+
+	void ResetSegments();
+	void ResetChunks();
+
+	SharedChunk& GetChunk(int x, int y, int z) { return m_chunks[(y * m_chunksZ + z) * m_chunksX + x]; }
+	const SharedChunk& GetChunk(int x, int y, int z) const { return m_chunks[(y * m_chunksZ + z) * m_chunksX + x]; }
+
+	bool IsInBounds(int x, int y, int z) const { return x >= 0 && y >= 0 && z >= 0 && x < m_x && y < m_y && z < m_z; }
 
 	std::string m_filename;
 
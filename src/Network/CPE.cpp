@@ -12,7 +12,7 @@ bool CPE::IsValidBlock(uint8_t type)
 
 void CPE::SendExtInfo(Client* client, std::string appName, short extCount)
 {
-		Packet* packet = new Packet(CPE::PacketType::kExtInfo);
+		auto packet = std::make_shared<Packet>(CPE::PacketType::kExtInfo);
 
 		packet->Write(appName);
 		packet->Write(extCount);
@@ -22,7 +22,7 @@ void CPE::SendExtInfo(Client* client, std::string appName, short extCount)
 
 void CPE::SendExtEntry(Client* client, std::string extName, int version)
 {
-		Packet* packet = new Packet(CPE::PacketType::kExtEntry);
+		auto packet = std::make_shared<Packet>(CPE::PacketType::kExtEntry);
 
 		packet->Write(extName);
 		packet->Write(version);
@@ -32,7 +32,7 @@ void CPE::SendExtEntry(Client* client, std::string extName, int version)
 
 void CPE::SendCustomBlocks(Client* client, uint8_t support)
 {
-		Packet* packet = new Packet(CPE::PacketType::kCustomBlocks);
+		auto packet = std::make_shared<Packet>(CPE::PacketType::kCustomBlocks);
 
 		packet->Write(support);
 
@@ -5,6 +5,8 @@
 
 #include <cstdint>
 
+#include <string>
+
 #include "ClientStream.hpp"
 #include "Packet.hpp"
 
@@ -44,15 +46,14 @@ struct cextinfop {
 
 	bool Read(ClientStream& stream)
 	{
-		uint8_t buffer[67];
-		if (!stream.consume_data(buffer, sizeof(buffer))) return false;
+		const uint8_t* data = stream.peek(67);
+		if (data == nullptr) return false;
 
-		Packet packet;
-		packet.Write(buffer, sizeof(buffer));
+		opcode = data[0];
+		appName.assign((const char*)&data[1], 64);
+		extCount = read_short(&data[65]);
 
-		packet.Read(extCount);
-		packet.Read(appName);
-		//packet.Read(opcode);
+		stream.consume(67);
 
 		return true;
 	}
@@ -61,19 +62,18 @@ struct cextinfop {
 struct cextentryp {
 	uint8_t opcode;
 	std::string extName;
-	short version;
+	int32_t version;
 
 	bool Read(ClientStream& stream)
 	{
-		uint8_t buffer[69];
-		if (!stream.consume_data(buffer, sizeof(buffer))) return false;
+		const uint8_t* data = stream.peek(69);
+		if (data == nullptr) return false;
 
-		Packet packet;
-		packet.Write(buffer, sizeof(buffer));
+		opcode = data[0];
+		extName.assign((const char*)&data[1], 64);
+		version = read_int(&data[65]);
 
-		packet.Read(version);
-		packet.Read(extName);
-		//packet.Read(opcode);
+		stream.consume(69);
 
 		return true;
 	}
@@ -85,14 +85,13 @@ struct ccustomblockp {
 
 	bool Read(ClientStream& stream)
 	{
-		uint8_t buffer[2];
-		if (!stream.consume_data(buffer, sizeof(buffer))) return false;
+		const uint8_t* data = stream.peek(2);
+		if (data == nullptr) return false;
 
-		Packet packet;
-		packet.Write(buffer, sizeof(buffer));
+		opcode = data[0];
+		support = data[1];
 
-		packet.Read(support);
-		//packet.Read(opcode);
+		stream.consume(2);
 
 		return true;
 	}
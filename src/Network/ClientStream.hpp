@@ -1,41 +1,112 @@
 ﻿#ifndef CLIENTSTREAM_H_
 #define CLIENTSTREAM_H_
 
+#include <cstdint>
 #include <cstring>
 
-#include <SFML/Network.hpp>
+#include <algorithm>
 
-// Copied from moderator hplus0603 at gamedev.net
-// Modified
+#ifdef __linux__
+	#include <arpa/inet.h>
+#elif _WIN32
+	#include <winsock2.h>
+#endif
+
+#include "Socket.hpp"
+
+// Originally copied from moderator hplus0603 at gamedev.net
+// Now a ring buffer: packets are decoded in place with peek() and dropped with consume(), nothing is shifted
 struct ClientStream {
-	sf::TcpSocket *socket;
+	enum { kBufferSize = 8192 /* must be a power of two */, kMaxPacketSize = 256 };
+
+	Socket *socket;
 	size_t count;
-	char buf[8192];
 
 	ClientStream() {
 		socket = nullptr;
 		count = 0;
+		m_head = 0;
 	}
 
 	sf::Socket::Status poll() {
-		if (count == 8192) { return sf::Socket::Status::NotReady; }
-			size_t size = 8192-count;
+		if (count == kBufferSize) { return sf::Socket::Status::NotReady; }
+
+		sf::Socket::Status status = sf::Socket::Status::Done;
+
+		// Free space wraps around the end of the buffer at most once
+		while (count < kBufferSize) {
+			size_t tail = (m_head + count) & (kBufferSize - 1);
+			size_t size = std::min<size_t>(kBufferSize - count, kBufferSize - tail);
 
 			size_t r = 0;
-			sf::Socket::Status status = socket->receive((void*)&buf[count], size, r);
+			status = socket->receive((void*)&m_buf[tail], size, r);
+
+			count += r;
 
-			if (r > 0) { count += r; }
+			if (status != sf::Socket::Status::Done || r < size) { break; }
+		}
 
-			return status;
+		return status;
 	}
 
-	bool consume_data(void *dst, size_t size) {
-		if (count < size) { return false; }
-		std::memcpy(dst, buf, size);
-		std::memmove(buf, &buf[size], count-size);
-		count -= size;
+	// Appends bytes framed elsewhere (by an I/O thread) instead of reading the socket
+	bool push(const uint8_t* data, size_t size) {
+		if (kBufferSize - count < size) { return false; }
+
+		size_t tail = (m_head + count) & (kBufferSize - 1);
+		size_t first = std::min(size, kBufferSize - tail);
+
+		std::memcpy(&m_buf[tail], data, first);
+		std::memcpy(m_buf, data + first, size - first);
+
+		count += size;
+
 		return true;
 	}
+
+	// Opcode of the next packet, only valid if count > 0
+	uint8_t front() const { return m_buf[m_head]; }
+
+	// Contiguous view of the next size bytes or nullptr if they haven't all arrived
+	// Only a packet straddling the end of the ring gets copied
+	const uint8_t* peek(size_t size) {
+		if (count < size || size > kMaxPacketSize) { return nullptr; }
+
+		if (m_head + size <= kBufferSize) { return &m_buf[m_head]; }
+
+		size_t first = kBufferSize - m_head;
+		std::memcpy(m_linear, &m_buf[m_head], first);
+		std::memcpy(&m_linear[first], m_buf, size - first);
+
+		return m_linear;
+	}
+
+	void consume(size_t size) {
+		count -= std::min(size, count);
+
+		// Rewind when empty so most packets never straddle the end
+		m_head = (count == 0) ? 0 : ((m_head + size) & (kBufferSize - 1));
+	}
+
+private:
+	size_t m_head;
+	uint8_t m_buf[kBufferSize];
+	uint8_t m_linear[kMaxPacketSize];
 };
 
+// Big-endian field readers for decoding packets straight out of peek()
+inline int16_t read_short(const uint8_t* data)
+{
+	uint16_t value;
+	std::memcpy(&value, data, sizeof(value));
+	return (int16_t)ntohs(value);
+}
+
+inline int32_t read_int(const uint8_t* data)
+{
+	uint32_t value;
+	std::memcpy(&value, data, sizeof(value));
+	return (int32_t)ntohl(value);
+}
+
 #endif // CLIENTSTREAM_H_
@@ -0,0 +1,121 @@
+﻿#include "EgressScheduler.hpp"
+
+#include <cstdint>
+#include <algorithm>
+
+#include "../Client.hpp"
+#include "../Utils/Metrics.hpp"
+
+EgressScheduler::EgressScheduler() : m_rate(0), m_tokens(0), m_fraction(0)
+{
+}
+
+bool EgressScheduler::IsBacklogged(Client* client)
+{
+	return client->writable && client->HasQueuedPackets();
+}
+
+int EgressScheduler::GetWeight(Client* client)
+{
+	return client->IsDownloadingMap() ? kMapWeight : kGameWeight;
+}
+
+void EgressScheduler::Schedule(const std::vector<Client*>& clients)
+{
+	if (!IsLimited())
+		return;
+
+	int64_t elapsedUs = m_clock.restart().asMicroseconds();
+
+	// Called every few milliseconds, truncating each refill would lose a good part of a low rate
+	int64_t refill = (int64_t)m_rate * elapsedUs + m_fraction;
+	m_tokens += refill / 1000000;
+	m_fraction = refill % 1000000;
+
+	int64_t maxTokens = (int64_t)m_rate * kMaxBurstMs / 1000;
+	if (m_tokens >= maxTokens) {
+		m_tokens = maxTokens;
+		m_fraction = 0;
+	}
+
+	// Idle clients don't save up tokens
+	for (auto& client : clients) {
+		if (!IsBacklogged(client)) {
+			m_tokens += client->sendTokens;
+			client->sendTokens = 0;
+		}
+	}
+
+	Distribute(clients);
+}
+
+bool EgressScheduler::Redistribute(const std::vector<Client*>& clients)
+{
+	if (!IsLimited())
+		return false;
+
+	bool backlogged = false;
+
+	for (auto& client : clients) {
+		if (IsBacklogged(client)) {
+			backlogged = true;
+		} else {
+			m_tokens += client->sendTokens;
+			client->sendTokens = 0;
+		}
+	}
+
+	if (!backlogged || m_tokens <= 0)
+		return false;
+
+	Distribute(clients);
+
+	return true;
+}
+
+void EgressScheduler::Distribute(const std::vector<Client*>& clients)
+{
+	int64_t totalWeight = 0;
+	for (auto& client : clients) {
+		if (IsBacklogged(client))
+			totalWeight += GetWeight(client);
+	}
+
+	if (totalWeight == 0 || m_tokens <= 0)
+		return;
+
+	int64_t available = m_tokens;
+
+	// Bucket is capped so a stalled client can't hoard the uplink
+	int64_t maxClientTokens = std::max<int64_t>(kMinClientBurst, (int64_t)m_rate * kMaxBurstMs / 1000);
+
+	for (auto& client : clients) {
+		if (!IsBacklogged(client))
+			continue;
+
+		int64_t grant = available * GetWeight(client) / totalWeight;
+
+		grant = std::min<int64_t>(grant, maxClientTokens - client->sendTokens);
+		if (grant <= 0)
+			continue;
+
+		client->sendTokens += grant;
+		m_tokens -= grant;
+	}
+}
+
+size_t EgressScheduler::GetAllowance(Client* client)
+{
+	if (!IsLimited())
+		return SIZE_MAX;
+
+	return (size_t)std::max<int64_t>(0, client->sendTokens);
+}
+
+void EgressScheduler::OnSent(Client* client, size_t sent)
+{
+	Metrics::GetMetrics()->Add(client->IsDownloadingMap() ? "egress_bytes_map" : "egress_bytes_game", (int64_t)sent);
+
+	if (IsLimited())
+		client->sendTokens -= (int64_t)sent;
+}
@@ -0,0 +1,49 @@
+﻿#ifndef EGRESSSCHEDULER_H_
+#define EGRESSSCHEDULER_H_
+
+#include <cstdint>
+#include <cstddef>
+
+#include <vector>
+
+#include <SFML/System.hpp>
+
+class Client;
+
+// Shares a global bytes/sec budget between clients with queued packets. Each client has a token bucket
+// filled by weight, in-game clients weigh more than ones downloading a map so gameplay updates keep
+// flowing during mass joins. Tokens a client can't use go to the others in a second pass.
+class EgressScheduler {
+public:
+	enum { kGameWeight = 4, kMapWeight = 1 };
+
+	EgressScheduler();
+
+	void SetRate(size_t rate) { m_rate = rate; }
+	size_t GetRate() const { return m_rate; }
+	bool IsLimited() const { return m_rate > 0; }
+
+	// Refills the global bucket, then hands it out to the clients that have something to send
+	void Schedule(const std::vector<Client*>& clients);
+	// Takes back tokens from clients that emptied their queue or filled their socket and hands them out again
+	bool Redistribute(const std::vector<Client*>& clients);
+
+	size_t GetAllowance(Client* client);
+	void OnSent(Client* client, size_t sent);
+
+private:
+	enum { kMaxBurstMs = 250, kMinClientBurst = 64 * 1024 /* bytes */ };
+
+	size_t m_rate; // Bytes per second, 0 for unlimited
+	int64_t m_tokens;
+	int64_t m_fraction; // Refill left over from the last Schedule(), in millionths of a byte
+
+	sf::Clock m_clock;
+
+	static bool IsBacklogged(Client* client);
+	static int GetWeight(Client* client);
+
+	void Distribute(const std::vector<Client*>& clients);
+};
+
+#endif // EGRESSSCHEDULER_H_
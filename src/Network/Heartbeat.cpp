@@ -0,0 +1,142 @@
+﻿#include "Heartbeat.hpp"
+
+#include <cstdlib>
+#include <chrono>
+#include <algorithm>
+
+#include <SFML/Network.hpp>
+
+#include "../Utils/Logger.hpp"
+
+Heartbeat::Heartbeat() : m_port(0), m_stopping(false), m_results(kResultCapacity)
+{
+}
+
+Heartbeat::~Heartbeat()
+{
+	Stop();
+}
+
+bool Heartbeat::Start(const std::string& url)
+{
+	// Split into scheme and host, port and URI since sf::Http takes them separately
+	size_t hostStart = url.find("://");
+	hostStart = (hostStart == std::string::npos) ? 0 : hostStart + 3;
+
+	size_t uriStart = url.find('/', hostStart);
+	if (uriStart == std::string::npos)
+		uriStart = url.size();
+
+	std::string host = url.substr(hostStart, uriStart - hostStart);
+	if (host.empty()) {
+		LOG(LogLevel::kWarning, "Invalid heartbeat URL '%s'", url.c_str());
+		return false;
+	}
+
+	size_t portStart = host.find(':');
+	if (portStart != std::string::npos) {
+		m_port = (unsigned short)std::atoi(host.c_str() + portStart + 1);
+		host.erase(portStart);
+	}
+
+	m_host = url.substr(0, hostStart) + host;
+	m_uri = (uriStart < url.size()) ? url.substr(uriStart) : "/";
+
+	m_stopping = false;
+	m_thread = std::thread(&Heartbeat::Run, this);
+
+	return true;
+}
+
+void Heartbeat::Stop()
+{
+	if (!m_thread.joinable())
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stopping = true;
+	}
+
+	m_condition.notify_one();
+
+	// Waits out a request in flight, at most kTimeout
+	m_thread.join();
+}
+
+void Heartbeat::Send(const std::string& postData)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_request = postData;
+	}
+
+	m_condition.notify_one();
+}
+
+bool Heartbeat::PollResult(Result& result)
+{
+	return m_results.Pop(result);
+}
+
+void Heartbeat::Run()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	while (!m_stopping) {
+		if (m_request.empty()) {
+			m_condition.wait(lock);
+			continue;
+		}
+
+		std::string postData;
+		postData.swap(m_request);
+
+		lock.unlock();
+
+		Result result;
+		int backoff = kInitialBackoff;
+
+		while (true) {
+			Post(postData, result);
+
+			if (result.ok || result.attempts >= kMaxAttempts)
+				break;
+
+			// A newer heartbeat has fresher numbers, no point retrying this one
+			lock.lock();
+			bool interrupted = m_condition.wait_for(lock, std::chrono::seconds(backoff), [this] { return m_stopping || !m_request.empty(); });
+			lock.unlock();
+
+			if (interrupted)
+				break;
+
+			backoff = std::min(backoff * 2, (int)kMaxBackoff);
+		}
+
+		// The game thread polls every tick, a full queue only happens if it's stuck
+		m_results.Push(std::move(result));
+
+		lock.lock();
+	}
+}
+
+// Doesn't use https
+void Heartbeat::Post(const std::string& postData, Result& result)
+{
+	sf::Http http;
+	http.setHost(m_host, m_port);
+
+	sf::Http::Request request;
+
+	request.setMethod(sf::Http::Request::Post);
+	request.setUri(m_uri);
+	request.setBody(postData);
+
+	sf::Http::Response response = http.sendRequest(request, sf::seconds(kTimeout));
+
+	result.attempts++;
+	result.status = (int)response.getStatus();
+	result.ok = (response.getStatus() == sf::Http::Response::Status::Ok);
+	result.body = response.getBody();
+}
@@ -0,0 +1,60 @@
+﻿#ifndef HEARTBEAT_H_
+#define HEARTBEAT_H_
+
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "../Utils/SpscQueue.hpp"
+
+// Posts heartbeats to the server list from a worker thread so a slow or unreachable list server can't stall
+// the game. Failed heartbeats are retried with exponential backoff until a newer one replaces them.
+class Heartbeat {
+public:
+	struct Result {
+		bool ok;
+		int status; // HTTP status, or SFML's codes above 1000 for connection problems
+		int attempts;
+		std::string body; // ClassiCube answers with the server's play URL
+
+		Result() : ok(false), status(0), attempts(0) {}
+	};
+
+	Heartbeat();
+
+	~Heartbeat();
+
+	// url is like http://www.classicube.net/server/heartbeat, a port may follow the host
+	bool Start(const std::string& url);
+	void Stop();
+
+	bool IsRunning() const { return m_thread.joinable(); }
+
+	// Game thread side; a heartbeat still waiting or retrying is replaced
+	void Send(const std::string& postData);
+	bool PollResult(Result& result);
+
+private:
+	enum { kTimeout = 10 /* seconds */, kMaxAttempts = 4, kInitialBackoff = 5 /* seconds */, kMaxBackoff = 20 /* seconds */ };
+	enum { kResultCapacity = 16 };
+
+	std::string m_host;
+	unsigned short m_port;
+	std::string m_uri;
+
+	std::thread m_thread;
+	std::mutex m_mutex;
+	std::condition_variable m_condition;
+
+	// Guarded by m_mutex
+	std::string m_request;
+	bool m_stopping;
+
+	SpscQueue<Result> m_results;
+
+	void Run();
+	void Post(const std::string& postData, Result& result);
+};
+
+#endif // HEARTBEAT_H_
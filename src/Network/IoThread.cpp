@@ -0,0 +1,497 @@
+﻿#include "IoThread.hpp"
+
+#include <cstring>
+#include <algorithm>
+
+#ifdef __linux__
+	#include <sys/socket.h>
+	#include <sys/uio.h>
+	#include <sys/sendfile.h>
+	#include <unistd.h>
+	#include <cerrno>
+#endif
+
+#include "Protocol.hpp"
+#include "../Client.hpp"
+#include "../Utils/Logger.hpp"
+#include "../Utils/Metrics.hpp"
+
+IoThread::IoThread(Reactor& gameReactor) : m_gameReactor(gameReactor), m_wakePending(false), m_posted(false), m_running(false), m_commands(kCommandCapacity), m_events(kEventCapacity), m_numClients(0), m_bytesIn(0), m_bytesOut(0), m_framesIn(0)
+{
+}
+
+IoThread::~IoThread()
+{
+	Stop();
+}
+
+void IoThread::AddClient(Client* client)
+{
+	client->SetIoChannel(std::unique_ptr<IoChannel>(new IoChannel(this)));
+
+	PushCommand(client, kCommandAdd);
+	m_numClients++;
+}
+
+void IoThread::RemoveClient(Client* client)
+{
+	PushCommand(client, kCommandRemove);
+	m_numClients--;
+}
+
+void IoThread::Flush(Client* client)
+{
+	// The I/O thread clears the flag before taking packets, so whatever was handed off before this is seen
+	if (!client->GetIoChannel()->flushPending.exchange(true))
+		PushCommand(client, kCommandFlush);
+}
+
+void IoThread::OnConsumed(Client* client, size_t bytes)
+{
+	IoChannel* channel = client->GetIoChannel();
+
+	if (bytes > 0)
+		channel->inboundBytes -= bytes;
+
+	if (channel->paused.exchange(false))
+		PushCommand(client, kCommandResume);
+}
+
+bool IoThread::PollEvent(Event& event)
+{
+	return m_events.Pop(event);
+}
+
+void IoThread::Wake()
+{
+	if (!m_wakePending)
+		return;
+
+	m_wakePending = false;
+	m_reactor.Wakeup();
+}
+
+void IoThread::ReportMetrics()
+{
+	Metrics::GetMetrics()->Add("io_bytes_in", m_bytesIn.exchange(0));
+	Metrics::GetMetrics()->Add("io_bytes_out", m_bytesOut.exchange(0));
+	Metrics::GetMetrics()->Add("io_frames_in", m_framesIn.exchange(0));
+}
+
+#ifdef __linux__
+
+bool IoThread::Start()
+{
+	if (!m_reactor.Init())
+		return false;
+
+	m_running = true;
+	m_thread = std::thread(&IoThread::Run, this);
+
+	return true;
+}
+
+void IoThread::Stop()
+{
+	if (m_running.exchange(false)) {
+		m_wakePending = true;
+		Wake();
+
+		m_thread.join();
+	}
+
+	for (auto& obj : m_connections) {
+		for (auto& item : obj.second->sending) {
+			if (item.closeFd)
+				close(item.fd);
+		}
+	}
+
+	m_connections.clear();
+}
+
+void IoThread::PushCommand(Client* client, CommandType type)
+{
+	// Only fills up if the I/O thread is far behind, it's woken so it can make room
+	while (!m_commands.Push({ client, type })) {
+		m_wakePending = true;
+		Wake();
+
+		std::this_thread::yield();
+	}
+
+	m_wakePending = true;
+}
+
+void IoThread::Run()
+{
+	while (m_running) {
+		// Poll instead of sleeping while something is waiting for room in the event queue
+		int timeout = (m_blocked.empty() && m_overflow.empty()) ? -1 : 1;
+
+		for (auto& event : m_reactor.Wait(timeout)) {
+			Connection* conn = static_cast<Connection*>(event.data);
+			if (conn->closed)
+				continue;
+
+			if (event.flags & Reactor::kWritable)
+				SendPending(conn);
+
+			if (!conn->closed && (event.flags & (Reactor::kReadable | Reactor::kHangup)))
+				ReadFrames(conn);
+
+			// Reading is paused but the peer is gone, nothing else will report it
+			if (!conn->closed && !conn->reading && (event.flags & Reactor::kHangup))
+				Close(conn);
+		}
+
+		// Commands go last, a removed connection may still have had an event above
+		ProcessCommands();
+
+		while (!m_overflow.empty() && m_events.Push(std::move(m_overflow.front()))) {
+			m_overflow.pop_front();
+			m_posted = true;
+		}
+
+		if (!m_blocked.empty()) {
+			std::vector<Connection*> blocked;
+			blocked.swap(m_blocked);
+
+			for (auto& conn : blocked)
+				ReadFrames(conn);
+		}
+
+		// Once per pass rather than per event
+		if (m_posted) {
+			m_posted = false;
+			m_gameReactor.Wakeup();
+		}
+	}
+}
+
+void IoThread::ProcessCommands()
+{
+	Command command;
+
+	while (m_commands.Pop(command)) {
+		auto it = m_connections.find(command.client);
+
+		if (command.type == kCommandAdd) {
+			std::unique_ptr<Connection> conn(new Connection());
+			conn->client = command.client;
+			conn->channel = command.client->GetIoChannel();
+			conn->fd = command.client->stream.socket->getHandle();
+			conn->sendOffset = 0;
+			conn->buffered = 0;
+			conn->reading = true;
+			conn->writing = false;
+			conn->halted = false;
+			conn->closed = false;
+
+			if (!m_reactor.Add(conn->fd, conn.get())) {
+				conn->closed = true;
+				PostEvent(conn.get(), kEventClosed);
+			}
+
+			m_connections[command.client] = std::move(conn);
+			continue;
+		}
+
+		if (it == m_connections.end())
+			continue;
+
+		Connection* conn = it->second.get();
+
+		switch (command.type) {
+		case kCommandFlush:
+			conn->channel->flushPending = false;
+			TakeOutbound(conn);
+
+			if (!conn->closed && !conn->writing)
+				SendPending(conn);
+
+			break;
+		case kCommandResume:
+			if (!conn->closed && !conn->halted)
+				ReadFrames(conn);
+
+			break;
+		case kCommandRemove:
+			// Last chance for a kick message
+			TakeOutbound(conn);
+
+			if (!conn->closed)
+				SendPending(conn);
+
+			Release(conn);
+			m_connections.erase(it);
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+void IoThread::ReadFrames(Connection* conn)
+{
+	if (conn->closed)
+		return;
+
+	while (true) {
+		if (!DeliverFrames(conn)) {
+			UpdateInterest(conn, false, conn->writing);
+			return;
+		}
+
+		ssize_t r = recv(conn->fd, conn->buffer + conn->buffered, kReadBufferSize - conn->buffered, 0);
+
+		if (r > 0) {
+			conn->buffered += (size_t)r;
+			m_bytesIn += r;
+			continue;
+		}
+
+		if (r < 0 && errno == EINTR)
+			continue;
+
+		if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+
+		Close(conn);
+		return;
+	}
+
+	UpdateInterest(conn, true, conn->writing);
+}
+
+// Posts every complete packet in the buffer, returns false if reading has to stop for now
+bool IoThread::DeliverFrames(Connection* conn)
+{
+	if (conn->halted)
+		return false;
+
+	IoChannel* channel = conn->channel;
+	size_t pos = 0;
+	bool delivering = true;
+
+	while (pos < conn->buffered) {
+		uint8_t opcode = conn->buffer[pos];
+		size_t size = Protocol::GetClientPacketSize(opcode);
+
+		// Sent on its own so the game thread kicks the client
+		bool unknown = (size == 0);
+		if (unknown)
+			size = 1;
+
+		if (conn->buffered - pos < size)
+			break;
+
+		// Never more in flight than the client's stream can take, the game thread resumes reading once it catches up
+		if (channel->inboundBytes + size > ClientStream::kBufferSize) {
+			channel->paused = true;
+
+			// Game thread may have consumed in between, then it didn't see the flag
+			if (channel->inboundBytes + size > ClientStream::kBufferSize || !channel->paused.exchange(false)) {
+				delivering = false;
+				break;
+			}
+		}
+
+		Event event;
+		event.client = conn->client;
+		event.type = kEventFrame;
+		event.size = (uint16_t)size;
+		std::memcpy(event.data, &conn->buffer[pos], size);
+
+		if (!m_overflow.empty() || !m_events.Push(std::move(event))) {
+			m_blocked.push_back(conn);
+			delivering = false;
+			break;
+		}
+
+		channel->inboundBytes += size;
+		m_framesIn++;
+		m_posted = true;
+		pos += size;
+
+		if (unknown) {
+			conn->halted = true;
+			delivering = false;
+			break;
+		}
+	}
+
+	conn->buffered -= pos;
+	if (pos > 0 && conn->buffered > 0)
+		std::memmove(conn->buffer, &conn->buffer[pos], conn->buffered);
+
+	return delivering;
+}
+
+void IoThread::TakeOutbound(Connection* conn)
+{
+	IoOutboundItem item;
+
+	while (conn->channel->outbound.Pop(item))
+		conn->sending.push_back(std::move(item));
+}
+
+// Gathers many packets per syscall like Client::ProcessPacketsInQueue()
+void IoThread::SendPending(Connection* conn)
+{
+	while (!conn->sending.empty()) {
+		IoOutboundItem& front = conn->sending.front();
+
+		if (front.fd >= 0) {
+			off_t offset = (off_t)front.offset;
+
+			ssize_t sent = sendfile(conn->fd, front.fd, &offset, (size_t)(front.end - front.offset));
+			if (sent < 0 && errno == EINTR)
+				continue;
+
+			if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				break;
+
+			// Error, or the file got shorter than its header said
+			if (sent <= 0) {
+				Close(conn);
+				return;
+			}
+
+			front.offset += sent;
+			m_bytesOut += sent;
+
+			if (front.offset < front.end)
+				continue;
+
+			if (front.closeFd)
+				close(front.fd);
+
+			conn->sending.pop_front();
+			continue;
+		}
+
+		struct iovec iov[kMaxPacketsPerSend];
+		size_t count = 0;
+		size_t total = 0;
+
+		for (auto it = conn->sending.begin(); it != conn->sending.end() && it->fd < 0 && count < kMaxPacketsPerSend; ++it) {
+			size_t offset = (count == 0) ? conn->sendOffset : 0;
+
+			iov[count].iov_base = (void*)(it->packet->GetBufferPtr() + offset);
+			iov[count].iov_len = it->packet->GetLength() - offset;
+
+			total += iov[count].iov_len;
+			count++;
+		}
+
+		struct msghdr msg = {};
+		msg.msg_iov = iov;
+		msg.msg_iovlen = count;
+
+		ssize_t sent = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+		if (sent < 0 && errno == EINTR)
+			continue;
+
+		if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+
+		if (sent < 0) {
+			Close(conn);
+			return;
+		}
+
+		m_bytesOut += sent;
+
+		size_t remaining = (size_t)sent;
+		while (remaining > 0) {
+			size_t length = conn->sending.front().packet->GetLength() - conn->sendOffset;
+
+			if (remaining < length) {
+				conn->sendOffset += remaining;
+				break;
+			}
+
+			remaining -= length;
+			conn->sendOffset = 0;
+			conn->sending.pop_front();
+		}
+
+		if ((size_t)sent < total)
+			break;
+	}
+
+	UpdateInterest(conn, conn->reading, !conn->sending.empty());
+}
+
+void IoThread::UpdateInterest(Connection* conn, bool reading, bool writing)
+{
+	if (conn->closed || (reading == conn->reading && writing == conn->writing))
+		return;
+
+	conn->reading = reading;
+	conn->writing = writing;
+
+	m_reactor.Modify(conn->fd, conn, writing, reading);
+}
+
+// The socket failed or the peer went away; the connection stays until the game thread removes the client
+void IoThread::Close(Connection* conn)
+{
+	if (conn->closed)
+		return;
+
+	conn->closed = true;
+	m_reactor.Remove(conn->fd);
+
+	PostEvent(conn, kEventClosed);
+}
+
+void IoThread::Release(Connection* conn)
+{
+	if (!conn->closed) {
+		conn->closed = true;
+		m_reactor.Remove(conn->fd);
+	}
+
+	for (auto& item : conn->sending) {
+		if (item.closeFd)
+			close(item.fd);
+	}
+
+	conn->sending.clear();
+
+	m_blocked.erase(std::remove(m_blocked.begin(), m_blocked.end(), conn), m_blocked.end());
+
+	PostEvent(conn, kEventReleased);
+}
+
+void IoThread::PostEvent(Connection* conn, EventType type)
+{
+	Event event;
+	event.client = conn->client;
+	event.type = (uint8_t)type;
+	event.size = 0;
+
+	if (!m_overflow.empty() || !m_events.Push(std::move(event)))
+		m_overflow.push_back(event);
+
+	m_posted = true;
+}
+
+#else
+
+bool IoThread::Start()
+{
+	return false;
+}
+
+void IoThread::Stop()
+{
+}
+
+void IoThread::PushCommand(Client*, CommandType)
+{
+}
+
+#endif
@@ -0,0 +1,145 @@
+﻿#ifndef IOTHREAD_H_
+#define IOTHREAD_H_
+
+#include <cstdint>
+#include <cstddef>
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "ClientStream.hpp"
+#include "Packet.hpp"
+#include "Reactor.hpp"
+#include "../Utils/SpscQueue.hpp"
+
+class Client;
+class IoThread;
+
+// Something for the socket: a packet, or a range of a level stream file if fd >= 0. A file is handed off in
+// several ranges, the I/O thread closes it after the last one.
+struct IoOutboundItem {
+	SharedPacket packet;
+	int fd;
+	int64_t offset;
+	int64_t end;
+	bool closeFd;
+
+	IoOutboundItem() : fd(-1), offset(0), end(0), closeFd(false) {}
+};
+
+// Shared between a client on the game thread and the I/O thread its socket is pinned to
+struct IoChannel {
+	enum { kOutboundCapacity = 256 /* items */ };
+
+	IoThread* thread;
+	SpscQueue<IoOutboundItem> outbound;
+	std::atomic<size_t> inboundBytes; // Framed on the I/O thread but not yet dispatched by the game thread
+	std::atomic<bool> paused; // Reading stopped until the game thread catches up
+	std::atomic<bool> flushPending; // A flush command is queued, more packets don't need another
+
+	explicit IoChannel(IoThread* ioThread) : thread(ioThread), outbound(kOutboundCapacity), inboundBytes(0), paused(false), flushPending(false) {}
+};
+
+// Owns the sockets of the clients pinned to it and does all their syscalls. Complete packets are framed here
+// and posted to the game thread as events, packets the game thread hands off are written out from here.
+// Only implemented on Linux, Start() fails elsewhere and the server keeps doing I/O on the game thread.
+class IoThread {
+public:
+	enum EventType { kEventFrame, kEventClosed, kEventReleased };
+
+	struct Event {
+		Client* client;
+		uint8_t type;
+		uint16_t size;
+		uint8_t data[ClientStream::kMaxPacketSize];
+	};
+
+	// The game thread's reactor is woken whenever events were posted
+	explicit IoThread(Reactor& gameReactor);
+
+	~IoThread();
+
+	bool Start();
+	void Stop();
+
+	// Game thread side; commands are picked up once Wake() is called
+	void AddClient(Client* client);
+	void RemoveClient(Client* client); // Sends what's left, then posts kEventReleased; the client can be deleted after that
+	void Flush(Client* client);
+	void OnConsumed(Client* client, size_t bytes);
+	void Wake();
+
+	bool PollEvent(Event& event);
+
+	size_t GetNumClients() const { return m_numClients; }
+
+	// Moves the thread's counters into the server metrics, game thread only
+	void ReportMetrics();
+
+private:
+	enum { kCommandCapacity = 4096, kEventCapacity = 4096, kReadBufferSize = 4096, kMaxPacketsPerSend = 64 };
+	enum CommandType { kCommandAdd, kCommandRemove, kCommandFlush, kCommandResume };
+
+	struct Command {
+		Client* client;
+		CommandType type;
+	};
+
+	struct Connection {
+		Client* client;
+		IoChannel* channel;
+		int fd;
+
+		std::deque<IoOutboundItem> sending;
+		size_t sendOffset; // Bytes of the front packet already sent
+
+		uint8_t buffer[kReadBufferSize];
+		size_t buffered;
+
+		bool reading; // Registered for readability
+		bool writing; // Registered for writability
+		bool halted; // Unknown opcode, nothing after it can be framed
+		bool closed;
+	};
+
+	Reactor m_reactor;
+	Reactor& m_gameReactor;
+	bool m_wakePending; // Game thread only
+	bool m_posted; // I/O thread only, events were posted since the game thread was last woken
+
+	std::thread m_thread;
+	std::atomic<bool> m_running;
+
+	SpscQueue<Command> m_commands;
+	SpscQueue<Event> m_events;
+
+	size_t m_numClients; // Game thread only
+
+	// I/O thread only
+	std::unordered_map<Client*, std::unique_ptr<Connection>> m_connections;
+	std::vector<Connection*> m_blocked; // Frames waiting for room in the event queue
+	std::deque<Event> m_overflow; // Closed and released events that didn't fit, order is kept
+
+	std::atomic<int64_t> m_bytesIn;
+	std::atomic<int64_t> m_bytesOut;
+	std::atomic<int64_t> m_framesIn;
+
+	void PushCommand(Client* client, CommandType type);
+	void PostEvent(Connection* conn, EventType type);
+
+	void Run();
+	void ProcessCommands();
+	void ReadFrames(Connection* conn);
+	bool DeliverFrames(Connection* conn);
+	void SendPending(Connection* conn);
+	void TakeOutbound(Connection* conn);
+	void UpdateInterest(Connection* conn, bool reading, bool writing);
+	void Close(Connection* conn);
+	void Release(Connection* conn);
+};
+
+#endif // IOTHREAD_H_
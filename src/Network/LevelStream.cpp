@@ -0,0 +1,137 @@
+﻿#include "LevelStream.hpp"
+
+#include <cstdio>
+#include <algorithm>
+
+#ifdef __linux__
+	#include <arpa/inet.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <sys/stat.h>
+#elif _WIN32
+	#include <winsock2.h>
+#endif
+
+#include "Protocol.hpp"
+#include "Packet.hpp"
+#include "../Utils/Deflate.hpp"
+#include "../Utils/Logger.hpp"
+#include "../Utils/Utils.hpp"
+
+LevelStream::LevelStream() : m_fd(-1), m_offset(0), m_length(0)
+{
+}
+
+LevelStream::~LevelStream()
+{
+	Close();
+}
+
+bool LevelStream::Write(const std::string& filename, const std::vector<uint8_t>& compressed, size_t rawSize, Position size)
+{
+	std::vector<SharedPacket> packets;
+
+	packets.push_back(std::make_shared<Packet>(Protocol::PacketType::kServerLevelInit));
+
+	size_t compSize = compressed.size();
+	for (size_t bytes = 0; bytes < compSize;) {
+		size_t count = std::min<size_t>(1024, compSize - bytes);
+		bytes += count;
+
+		uint8_t percent = (uint8_t)(((float)bytes / (float)compSize) * 100.0f);
+		packets.push_back(Protocol::make_level_data_packet(&compressed[bytes - count], count, percent));
+	}
+
+	packets.push_back(Protocol::make_level_final_packet(size));
+
+	Header header = {};
+	header.magic = htonl(kMagic);
+	header.formatVersion = htonl(kFormatVersion);
+	header.checksum = htonl(Deflate::ReadGzipCrc(compressed));
+	header.rawSize = htonl((uint32_t)rawSize);
+	header.x = htons(size.x);
+	header.y = htons(size.y);
+	header.z = htons(size.z);
+
+	uint32_t length = 0;
+	for (auto& packet : packets)
+		length += packet->GetLength();
+
+	header.length = htonl(length);
+
+	bool ok = Utils::WriteFileAtomically(filename, [&header, &packets](std::FILE* fp) {
+		if (std::fwrite(&header, sizeof(header), 1, fp) != 1)
+			return false;
+
+		for (auto& packet : packets) {
+			if (std::fwrite(packet->GetBufferPtr(), 1, packet->GetLength(), fp) != packet->GetLength())
+				return false;
+		}
+
+		return true;
+	});
+
+	if (!ok) {
+		LOG(LogLevel::kWarning, "Couldn't write level stream %s", filename.c_str());
+		return false;
+	}
+
+	LOG(LogLevel::kDebug, "Wrote level stream %s (%u bytes)", filename.c_str(), length);
+
+	return true;
+}
+
+bool LevelStream::Open(const std::string& filename, uint32_t checksum, size_t rawSize, Position size)
+{
+	Close();
+
+#ifdef __linux__
+	int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	Header header;
+	struct stat st;
+
+	bool valid = read(fd, &header, sizeof(header)) == (ssize_t)sizeof(header)
+		&& fstat(fd, &st) == 0
+		&& ntohl(header.magic) == kMagic
+		&& ntohl(header.formatVersion) == kFormatVersion
+		&& ntohl(header.checksum) == checksum
+		&& ntohl(header.rawSize) == (uint32_t)rawSize
+		&& (int16_t)ntohs(header.x) == size.x
+		&& (int16_t)ntohs(header.y) == size.y
+		&& (int16_t)ntohs(header.z) == size.z
+		&& (size_t)st.st_size == sizeof(header) + ntohl(header.length);
+
+	if (!valid) {
+		close(fd);
+		return false;
+	}
+
+	m_fd = fd;
+	m_offset = sizeof(header);
+	m_length = ntohl(header.length);
+
+	return true;
+#else
+	(void)filename;
+	(void)checksum;
+	(void)rawSize;
+	(void)size;
+
+	return false; // Needs sendfile()
+#endif
+}
+
+void LevelStream::Close()
+{
+#ifdef __linux__
+	if (m_fd >= 0)
+		close(m_fd);
+#endif
+
+	m_fd = -1;
+	m_offset = 0;
+	m_length = 0;
+}
@@ -0,0 +1,50 @@
+﻿#ifndef LEVELSTREAM_H_
+#define LEVELSTREAM_H_
+
+#include <cstdint>
+#include <cstddef>
+
+#include <string>
+#include <vector>
+
+#include "../Position.hpp"
+
+// The framed LevelInit, LevelData and LevelFinal packets for a map, kept next to it on disk so joins can be
+// served with sendfile() straight from the page cache. The header ties the file to the map it was built from.
+class LevelStream {
+public:
+	LevelStream();
+
+	~LevelStream();
+
+	// Writes a temporary file and renames it over the old one, so a file that's being served is never changed in place
+	static bool Write(const std::string& filename, const std::vector<uint8_t>& compressed, size_t rawSize, Position size);
+
+	// Keeps the file open only if it was written for a map with this checksum and size
+	bool Open(const std::string& filename, uint32_t checksum, size_t rawSize, Position size);
+	void Close();
+
+	bool IsOpen() const { return m_fd >= 0; }
+	int GetFd() const { return m_fd; }
+	size_t GetOffset() const { return m_offset; }
+	size_t GetLength() const { return m_length; }
+
+private:
+	enum { kMagic = 0x4d434c53 /* MCLS */, kFormatVersion = 1 };
+
+	struct Header {
+		uint32_t magic;
+		uint32_t formatVersion;
+		uint32_t checksum;
+		uint32_t rawSize;
+		int16_t x, y, z;
+		uint16_t padding;
+		uint32_t length; // Bytes of packets after the header
+	};
+
+	int m_fd;
+	size_t m_offset;
+	size_t m_length;
+};
+
+#endif // LEVELSTREAM_H_
@@ -2,6 +2,7 @@
 #define PACKET_H_
 
 #include <string>
+#include <memory>
 
 #include "../Utils/BufferStream.hpp"
 
@@ -20,4 +21,7 @@ private:
 	int8_t m_opcode;
 };
 
+// Packets are immutable once queued, one encoded packet can sit in many client queues
+typedef std::shared_ptr<const Packet> SharedPacket;
+
 #endif // PACKET_H_
@@ -1,8 +1,27 @@
 ﻿#include "Protocol.hpp"
 
 #include "Packet.hpp"
+#include "CPE.hpp"
 #include "../Map.hpp"
 #include "../Utils/Logger.hpp"
+#include "../Utils/Metrics.hpp"
+
+namespace {
+
+enum { kTeleportPacketSize = 10 };
+
+bool SameEntityState(const EntityState& a, const EntityState& b)
+{
+	return a.valid == b.valid && a.pos.x == b.pos.x && a.pos.y == b.pos.y && a.pos.z == b.pos.z
+		&& a.yaw == b.yaw && a.pitch == b.pitch;
+}
+
+bool FitsInByte(int value)
+{
+	return value >= -128 && value <= 127;
+}
+
+} // namespace
 
 bool Protocol::IsValidBlock(uint8_t type)
 {
@@ -14,10 +33,24 @@ bool Protocol::IsValidBlock(uint8_t type)
 	return false;
 }
 
-Packet* Protocol::make_spawn_packet(int8_t pid, std::string name, Position position, int8_t yaw, int8_t pitch)
+size_t Protocol::GetClientPacketSize(uint8_t opcode)
+{
+	switch (opcode) {
+	case PacketType::kClientAuth:		return 131;
+	case PacketType::kClientBlock:		return 9;
+	case PacketType::kClientPosition:	return 10;
+	case PacketType::kClientMessage:	return 66;
+	case CPE::PacketType::kExtInfo:		return 67;
+	case CPE::PacketType::kExtEntry:	return 69;
+	case CPE::PacketType::kCustomBlocks:	return 2;
+	default:				return 0;
+	}
+}
+
+SharedPacket Protocol::make_spawn_packet(int8_t pid, std::string name, Position position, int8_t yaw, int8_t pitch)
 {
 	// Cast opcode because it's an initialized packet and we're writing the packet type, not constructing the packet
-	Packet* packet = new Packet(Protocol::PacketType::kServerSpawn);
+	auto packet = std::make_shared<Packet>(Protocol::PacketType::kServerSpawn);
 
 	packet->Write(pid); // Self PID
 	packet->Write(name);
@@ -30,141 +63,236 @@ Packet* Protocol::make_spawn_packet(int8_t pid, std::string name, Position posit
 	return packet;
 }
 
-void Protocol::SendInfo(Client* client, std::string serverName, std::string serverMOTD, uint8_t version, uint8_t userType)
+SharedPacket Protocol::make_message_packet(std::string message)
 {
-	Packet* packet = new Packet(Protocol::PacketType::kServerInfo);
+	auto packet = std::make_shared<Packet>(Protocol::PacketType::kServerMessage);
 
-	packet->Write((uint8_t)version);
-	packet->Write(serverName);
-	packet->Write(serverMOTD);
-	packet->Write((uint8_t)userType);
+	packet->Write((uint8_t)0);
+	packet->Write(message);
 
-	client->QueuePacket(packet);
+	return packet;
 }
 
-void Protocol::SendMessage(Client* client, std::string message)
+SharedPacket Protocol::make_block_packet(Position pos, uint8_t type)
 {
-	Packet* packet = new Packet(Protocol::PacketType::kServerMessage);
+	auto packet = std::make_shared<Packet>(Protocol::PacketType::kServerBlock);
 
-	packet->Write((uint8_t)0);
-	packet->Write(message);
+	packet->Write(htons(pos.x));
+	packet->Write(htons(pos.y));
+	packet->Write(htons(pos.z));
+	packet->Write(type);
 
-	client->QueuePacket(packet);
+	return packet;
 }
 
-void Protocol::SendMap(Client* client, Map& map)
+SharedPacket Protocol::make_level_data_packet(const uint8_t* data, size_t count, uint8_t percent)
 {
-	Packet* levelInitPacket = new Packet(Protocol::PacketType::kServerLevelInit);
-	client->QueuePacket(levelInitPacket);
+	auto packet = std::make_shared<Packet>(Protocol::PacketType::kServerLevelData);
 
-	uint8_t* compBuffer = nullptr;
-	size_t compSize;
+	packet->Write((int16_t)htons(count)); // length
 
-	map.CompressBuffer(&compBuffer, &compSize);
+	packet->BufferStream::Write((void*)data, count);
+	// Padding; must send exactly 1024 bytes per chunk
+	if (count < 1024) {
+		size_t paddingSize = 1024 - count;
+		packet->WriteZeroes(paddingSize);
+	}
 
-	LOG(LogLevel::kDebug, "Compressed map size: %d bytes", compSize);
+	packet->Write(percent);
 
-	size_t bytes = 0;
-	while (bytes < compSize) {
-		size_t remainingBytes = compSize - bytes;
-		size_t count = (remainingBytes >= 1024) ? 1024 : (remainingBytes);
+	return packet;
+}
 
-		Packet* packet = new Packet(Protocol::PacketType::kServerLevelData);
+SharedPacket Protocol::make_level_final_packet(Position size)
+{
+	auto packet = std::make_shared<Packet>(Protocol::PacketType::kServerLevelFinal);
 
-		packet->Write((int16_t)htons(count)); // length
+	packet->Write(htons(size.x));
+	packet->Write(htons(size.y));
+	packet->Write(htons(size.z));
 
-		packet->BufferStream::Write((void*)(&compBuffer[bytes]), count);
-		// Padding; must send exactly 1024 bytes per chunk
-		if (count < 1024) {
-			size_t paddingSize = 1024 - count;
-			packet->WriteZeroes(paddingSize);
-		}
+	return packet;
+}
+
+SharedPacket Protocol::make_teleport_packet(int8_t pid, Position pos, uint8_t yaw, uint8_t pitch)
+{
+	auto packet = std::make_shared<Packet>(Protocol::PacketType::kServerTeleport);
+
+	packet->Write(pid);
+	packet->Write(htons(pos.x));
+	packet->Write(htons(pos.y));
+	packet->Write(htons(pos.z));
+	packet->Write(yaw);
+	packet->Write(pitch);
 
-		bytes += count;
+	return packet;
+}
 
-		char percent = (char)(((float)bytes / (float)compSize) * 100.0f);
-		packet->Write((uint8_t)percent);
+// Picks the smallest encoding that gets an observer from its last known state to the new one
+SharedPacket Protocol::make_movement_packet(int8_t pid, const EntityState& from, Position pos, uint8_t yaw, uint8_t pitch)
+{
+	int dx = pos.x - from.pos.x;
+	int dy = pos.y - from.pos.y;
+	int dz = pos.z - from.pos.z;
 
-		//printf("%d/%d bytes | %d%%\n", (int)bytes, (int)bufferSize, (int)percent); // Debug
+	// Relative packets carry signed bytes, anything bigger (or no known state) needs a teleport
+	if (!from.valid || !FitsInByte(dx) || !FitsInByte(dy) || !FitsInByte(dz))
+		return make_teleport_packet(pid, pos, yaw, pitch);
 
-		client->QueuePacket(packet);
-	}
+	bool moved = (dx != 0 || dy != 0 || dz != 0);
+	bool rotated = (yaw != from.yaw || pitch != from.pitch);
 
-	free(compBuffer);
+	std::shared_ptr<Packet> packet;
 
-	int16_t mapX = map.GetXSize();
-	int16_t mapY = map.GetYSize();
-	int16_t mapZ = map.GetZSize();
+	if (moved && rotated) {
+		packet = std::make_shared<Packet>(Protocol::PacketType::kServerPositionOrientationChange);
+		packet->Write(pid);
+		packet->Write((int8_t)dx);
+		packet->Write((int8_t)dy);
+		packet->Write((int8_t)dz);
+		packet->Write(yaw);
+		packet->Write(pitch);
+	} else if (moved) {
+		packet = std::make_shared<Packet>(Protocol::PacketType::kServerPositionChange);
+		packet->Write(pid);
+		packet->Write((int8_t)dx);
+		packet->Write((int8_t)dy);
+		packet->Write((int8_t)dz);
+	} else {
+		packet = std::make_shared<Packet>(Protocol::PacketType::kServerDirection);
+		packet->Write(pid);
+		packet->Write(yaw);
+		packet->Write(pitch);
+	}
 
-	Packet* packet = new Packet(Protocol::PacketType::kServerLevelFinal);
+	return packet;
+}
+
+void Protocol::SendInfo(Client* client, std::string serverName, std::string serverMOTD, uint8_t version, uint8_t userType)
+{
+	auto packet = std::make_shared<Packet>(Protocol::PacketType::kServerInfo);
 
-	packet->Write(htons(mapX));
-	packet->Write(htons(mapY));
-	packet->Write(htons(mapZ));
+	packet->Write((uint8_t)version);
+	packet->Write(serverName);
+	packet->Write(serverMOTD);
+	packet->Write((uint8_t)userType);
 
 	client->QueuePacket(packet);
 }
 
+void Protocol::SendMessage(Client* client, std::string message)
+{
+	client->QueuePacket(make_message_packet(message));
+}
+
+void Protocol::SendMessage(const std::vector<Client*>& clients, std::string message)
+{
+	SharedPacket packet = make_message_packet(message);
+
+	for (auto& obj : clients)
+		obj->QueuePacket(packet);
+}
+
+void Protocol::SendLevelInit(Client* client)
+{
+	client->QueuePacket(std::make_shared<Packet>(Protocol::PacketType::kServerLevelInit));
+}
+
+void Protocol::SendLevelData(Client* client, std::shared_ptr<const std::vector<uint8_t>> compressed)
+{
+	// Packets are built from the shared buffer as the socket drains instead of all at once
+	client->StreamMap(compressed);
+}
+
+void Protocol::SendLevelFinal(Client* client, Map& map)
+{
+	client->QueuePacket(make_level_final_packet(Position(map.GetXSize(), map.GetYSize(), map.GetZSize())));
+}
+
 void Protocol::SendBlock(Client* client, Position pos, uint8_t type)
 {
-	Packet* packet = new Packet(Protocol::PacketType::kServerBlock);
+	client->QueuePacket(make_block_packet(pos, type));
+}
 
-	packet->Write(htons(pos.x));
-	packet->Write(htons(pos.y));
-	packet->Write(htons(pos.z));
-	packet->Write(type);
+void Protocol::SendBlock(const std::vector<Client*>& clients, Position pos, uint8_t type, Client* except)
+{
+	SharedPacket packet = make_block_packet(pos, type);
 
-	client->QueuePacket(packet);
+	for (auto& obj : clients) {
+		if (obj != except)
+			obj->QueuePacket(packet);
+	}
 }
 
 void Protocol::SendKick(Client* client, std::string reason)
 {
-	Packet* packet = new Packet(Protocol::PacketType::kServerKick);
+	auto packet = std::make_shared<Packet>(Protocol::PacketType::kServerKick);
 
 	packet->Write(reason);
 
-	client->QueuePacket(packet);
+	// Not held back while loading a map, the client is about to be disconnected
+	client->QueueUrgentPacket(packet);
 }
 
 void Protocol::SendPosition(Client* client, int8_t pid, Position pos, uint8_t yaw, uint8_t pitch)
 {
-	Packet* packet = new Packet(Protocol::PacketType::kServerTeleport);
-
-	packet->Write(pid);
-	packet->Write(htons(pos.x));
-	packet->Write(htons(pos.y));
-	packet->Write(htons(pos.z));
-	packet->Write(yaw);
-	packet->Write(pitch);
+	// Self teleports (-1) aren't tracked. Set before queueing, backpressure invalidates it again if the packet is dropped.
+	if (pid != -1) {
+		EntityState& state = client->GetEntityState(pid);
+		state.pos = pos;
+		state.yaw = yaw;
+		state.pitch = pitch;
+		state.valid = true;
+	}
 
-	client->QueuePacket(packet);
+	client->QueuePacket(make_teleport_packet(pid, pos, yaw, pitch));
 }
 
 void Protocol::SendPlayerPositionUpdate(Client* sender, const std::vector<Client*>& clients)
 {
-	// Do this on a timer in Tick()
-	// For now this will work
 	int8_t pid = sender->GetPid();
-	Position pos = sender->GetPosition();
+
+	EntityState current;
+	current.pos = sender->GetPosition();
+	current.yaw = sender->GetYaw();
+	current.pitch = sender->GetPitch();
+	current.valid = true;
+
+	// Observers usually share the same last known state, so one encoded packet serves all of them
+	EntityState lastFrom;
+	SharedPacket lastPacket;
+
+	int64_t bytesSent = 0;
+	int64_t bytesSaved = 0;
 
 	for (auto& obj : clients) {
-		if (obj->GetPid() != pid) {
-			Packet* packet = new Packet(Protocol::PacketType::kServerTeleport);
-			packet->Write(pid);
-			packet->Write(htons(pos.x));
-			packet->Write(htons(pos.y));
-			packet->Write(htons(pos.z));
-			packet->Write(sender->GetYaw());
-			packet->Write(sender->GetPitch());
+		if (obj == sender)
+			continue;
 
-			obj->QueuePacket(packet);
+		EntityState& state = obj->GetEntityState(pid);
+		if (SameEntityState(state, current))
+			continue;
+
+		if (lastPacket == nullptr || !SameEntityState(state, lastFrom)) {
+			lastFrom = state;
+			lastPacket = make_movement_packet(pid, state, current.pos, current.yaw, current.pitch);
 		}
+
+		// Dropped under backpressure, the state stays invalid and the next update is a teleport
+		if (!obj->QueueMovement(pid, lastPacket, state, current))
+			continue;
+
+		bytesSent += lastPacket->GetLength();
+		bytesSaved += kTeleportPacketSize - (int64_t)lastPacket->GetLength();
 	}
+
+	Metrics::GetMetrics()->Add("movement_bytes_sent", bytesSent);
+	Metrics::GetMetrics()->Add("movement_bytes_saved", bytesSaved);
 }
 
 void Protocol::SendUserType(Client* client, uint8_t userType)
 {
-	Packet* packet = new Packet(Protocol::PacketType::kServerUserType);
+	auto packet = std::make_shared<Packet>(Protocol::PacketType::kServerUserType);
 
 	packet->Write(userType);
 
@@ -179,8 +307,13 @@ void Protocol::SendClientsTo(Client* client, const std::vector<Client*>& clients
 
 		if (pid == clientPid) continue;
 
-		Packet* packet = make_spawn_packet(pid, obj->GetName(), obj->GetPosition(), obj->GetYaw(), obj->GetPitch());
-		client->QueuePacket(packet);
+		client->QueuePacket(make_spawn_packet(pid, obj->GetName(), obj->GetPosition(), obj->GetYaw(), obj->GetPitch()));
+
+		EntityState& state = client->GetEntityState(pid);
+		state.pos = obj->GetPosition();
+		state.yaw = obj->GetYaw();
+		state.pitch = obj->GetPitch();
+		state.valid = true;
 	}
 }
 
@@ -191,25 +324,34 @@ void Protocol::SpawnClient(Client* client, Position pos, const std::vector<Clien
 
 	client->SetPositionOrientation(pos, 0, 0);
 
-	Packet* selfSpawnPacket = make_spawn_packet(pid, name, pos, 0, 0);
-	client->QueuePacket(selfSpawnPacket);
+	client->QueuePacket(make_spawn_packet(pid, name, pos, 0, 0));
 
 	pid = client->GetPid(); // Actual PID
+
 	// Send client spawn to rest of clients
+	SharedPacket spawnPacket = make_spawn_packet(pid, name, pos, 0, 0);
+
 	for (auto& obj : clients) {
-		if (obj->GetPid() != pid) {
-			Packet* spawnPacket = make_spawn_packet(pid, name, pos, 0, 0);
-			obj->QueuePacket(spawnPacket);
-		}
+		if (obj == client)
+			continue;
+
+		obj->QueuePacket(spawnPacket);
+
+		EntityState& state = obj->GetEntityState(pid);
+		state.pos = pos;
+		state.yaw = 0;
+		state.pitch = 0;
+		state.valid = true;
 	}
 }
 
 void Protocol::DespawnClient(int8_t pid, const std::vector<Client*>& clients)
 {
-	for (auto& obj : clients) {
-		Packet* packet = new Packet(Protocol::PacketType::kServerDespawn);
-		packet->Write(pid);
+	auto packet = std::make_shared<Packet>(Protocol::PacketType::kServerDespawn);
+	packet->Write(pid);
 
+	for (auto& obj : clients) {
 		obj->QueuePacket(packet);
+		obj->GetEntityState(pid).valid = false;
 	}
 }
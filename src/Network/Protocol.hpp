@@ -7,6 +7,7 @@
 #include <vector>
 
 #include <cstdint>
+#include <cstring>
 
 #ifdef __linux__
 	#include <arpa/inet.h>
@@ -98,6 +99,7 @@ enum BlockType {
 };
 
 /* Client->Server */
+// Read() decodes in place from the stream's buffer, fields are at their wire offsets
 struct cauthp {
 	uint8_t opcode;
 	uint8_t version;
@@ -107,17 +109,16 @@ struct cauthp {
 
 	bool Read(ClientStream& stream)
 	{
-		uint8_t buffer[131];
-		if (!stream.consume_data(buffer, sizeof(buffer))) return false;
+		const uint8_t* data = stream.peek(131);
+		if (data == nullptr) return false;
 
-		Packet packet;
-		packet.Write(buffer, sizeof(buffer));
+		opcode = data[0];
+		version = data[1];
+		std::memcpy(name, &data[2], sizeof(name));
+		std::memcpy(key, &data[66], sizeof(key));
+		UNK0 = data[130];
 
-		packet.Read(UNK0);
-		packet.Read(key, sizeof(key));
-		packet.Read(name, sizeof(name));
-		packet.Read(version);
-		//packet.Read(opcode);
+		stream.consume(131);
 
 		return true;
 	}
@@ -130,15 +131,14 @@ struct cmsgp {
 
 	bool Read(ClientStream& stream)
 	{
-		uint8_t buffer[66];
-		if (!stream.consume_data(buffer, sizeof(buffer))) return false;
+		const uint8_t* data = stream.peek(66);
+		if (data == nullptr) return false;
 
-		Packet packet;
-		packet.Write(buffer, sizeof(buffer));
+		opcode = data[0];
+		flag = data[1];
+		std::memcpy(msg, &data[2], sizeof(msg));
 
-		packet.Read(msg, sizeof(msg));
-		packet.Read(flag);
-		//packet.Read(opcode);
+		stream.consume(66);
 
 		return true;
 	}
@@ -152,23 +152,18 @@ struct cposp {
 
 	bool Read(ClientStream& stream)
 	{
-		uint8_t buffer[10];
-		if (!stream.consume_data(buffer, sizeof(buffer))) return false;
+		const uint8_t* data = stream.peek(10);
+		if (data == nullptr) return false;
 
-		Packet packet;
-		packet.Write(buffer, sizeof(buffer));
+		opcode = data[0];
+		pid = data[1];
+		pos.x = read_short(&data[2]);
+		pos.y = read_short(&data[4]);
+		pos.z = read_short(&data[6]);
+		yaw = data[8];
+		pitch = data[9];
 
-		packet.Read(pitch);
-		packet.Read(yaw);
-		packet.Read(pos.z);
-		packet.Read(pos.y);
-		packet.Read(pos.x);
-		packet.Read(pid);
-		//packet.Read(opcode);
-
-		pos.x = ntohs(pos.x);
-		pos.y = ntohs(pos.y);
-		pos.z = ntohs(pos.z);
+		stream.consume(10);
 
 		return true;
 	}
@@ -182,22 +177,17 @@ struct cblockp {
 
 	bool Read(ClientStream& stream)
 	{
-		uint8_t buffer[9];
-		if (!stream.consume_data(buffer, sizeof(buffer))) return false;
-
-		Packet packet;
-		packet.Write(buffer, sizeof(buffer));
+		const uint8_t* data = stream.peek(9);
+		if (data == nullptr) return false;
 
-		packet.Read(type);
-		packet.Read(mode);
-		packet.Read(pos.z);
-		packet.Read(pos.y);
-		packet.Read(pos.x);
-		//packet.Read(opcode);
+		opcode = data[0];
+		pos.x = read_short(&data[1]);
+		pos.y = read_short(&data[3]);
+		pos.z = read_short(&data[5]);
+		mode = data[7];
+		type = data[8];
 
-		pos.x = ntohs(pos.x);
-		pos.y = ntohs(pos.y);
-		pos.z = ntohs(pos.z);
+		stream.consume(9);
 
 		return true;
 	}
@@ -205,13 +195,27 @@ struct cblockp {
 
 bool IsValidBlock(uint8_t type);
 
-Packet* make_spawn_packet(int8_t pid, std::string name, Position position, int8_t yaw, int8_t pitch);
+// Size of a client->server packet including its opcode, 0 if the opcode is unknown (covers CPE opcodes)
+size_t GetClientPacketSize(uint8_t opcode);
+
+// Packets are built once and can be queued to any number of clients
+SharedPacket make_spawn_packet(int8_t pid, std::string name, Position position, int8_t yaw, int8_t pitch);
+SharedPacket make_message_packet(std::string message);
+SharedPacket make_block_packet(Position pos, uint8_t type);
+SharedPacket make_level_data_packet(const uint8_t* data, size_t count, uint8_t percent);
+SharedPacket make_level_final_packet(Position size);
+SharedPacket make_teleport_packet(int8_t pid, Position pos, uint8_t yaw, uint8_t pitch);
+SharedPacket make_movement_packet(int8_t pid, const EntityState& from, Position pos, uint8_t yaw, uint8_t pitch);
 
 // Send packet functions
 void SendInfo(Client* client, std::string serverName, std::string serverMOTD, uint8_t version, uint8_t userType=0);
 void SendMessage(Client* client, std::string message);
-void SendMap(Client* client, Map& map);
+void SendMessage(const std::vector<Client*>& clients, std::string message);
+void SendLevelInit(Client* client);
+void SendLevelData(Client* client, std::shared_ptr<const std::vector<uint8_t>> compressed);
+void SendLevelFinal(Client* client, Map& map);
 void SendBlock(Client* client, Position pos, uint8_t type);
+void SendBlock(const std::vector<Client*>& clients, Position pos, uint8_t type, Client* except=nullptr);
 void SendKick(Client* client, std::string reason="");
 void SendPosition(Client* client, int8_t pid, Position pos, uint8_t yaw, uint8_t pitch);
 void SendPlayerPositionUpdate(Client* sender, const std::vector<Client*>& clients);
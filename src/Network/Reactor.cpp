@@ -0,0 +1,199 @@
+﻿#include "Reactor.hpp"
+
+#ifdef __linux__
+	#include <sys/eventfd.h>
+	#include <unistd.h>
+	#include <cerrno>
+#else
+	#include <SFML/System.hpp>
+#endif
+
+#include "../Utils/Logger.hpp"
+
+#ifdef __linux__
+
+Reactor::Reactor() : m_epollFd(-1), m_wakeFd(-1), m_numSockets(0)
+{
+	m_epollEvents.resize(64);
+}
+
+Reactor::~Reactor()
+{
+	if (m_epollFd >= 0)
+		close(m_epollFd);
+
+	if (m_wakeFd >= 0)
+		close(m_wakeFd);
+}
+
+bool Reactor::Init()
+{
+	m_epollFd = epoll_create1(EPOLL_CLOEXEC);
+	if (m_epollFd < 0) {
+		LOG(LogLevel::kError, "epoll_create1() failed (errno=%d)", errno);
+		return false;
+	}
+
+	m_wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (m_wakeFd < 0) {
+		LOG(LogLevel::kError, "eventfd() failed (errno=%d)", errno);
+		return false;
+	}
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = &m_wakeFd;
+
+	if (epoll_ctl(m_epollFd, EPOLL_CTL_ADD, m_wakeFd, &ev) < 0) {
+		LOG(LogLevel::kError, "epoll_ctl(ADD) failed for wakeup (errno=%d)", errno);
+		return false;
+	}
+
+	return true;
+}
+
+bool Reactor::Add(sf::SocketHandle handle, void* data, bool writable, bool readable)
+{
+	struct epoll_event ev;
+	ev.events = 0;
+	if (readable)
+		ev.events |= EPOLLIN;
+	if (writable)
+		ev.events |= EPOLLOUT;
+	ev.data.ptr = data;
+
+	if (epoll_ctl(m_epollFd, EPOLL_CTL_ADD, handle, &ev) < 0) {
+		LOG(LogLevel::kWarning, "epoll_ctl(ADD) failed for socket %d (errno=%d)", handle, errno);
+		return false;
+	}
+
+	m_numSockets++;
+
+	return true;
+}
+
+bool Reactor::Modify(sf::SocketHandle handle, void* data, bool writable, bool readable)
+{
+	struct epoll_event ev;
+	ev.events = 0;
+	if (readable)
+		ev.events |= EPOLLIN;
+	if (writable)
+		ev.events |= EPOLLOUT;
+	ev.data.ptr = data;
+
+	if (epoll_ctl(m_epollFd, EPOLL_CTL_MOD, handle, &ev) < 0) {
+		LOG(LogLevel::kWarning, "epoll_ctl(MOD) failed for socket %d (errno=%d)", handle, errno);
+		return false;
+	}
+
+	return true;
+}
+
+void Reactor::Remove(sf::SocketHandle handle)
+{
+	// Kernels before 2.6.9 require a non-null event even though it's ignored
+	struct epoll_event ev = {};
+	if (epoll_ctl(m_epollFd, EPOLL_CTL_DEL, handle, &ev) == 0 && m_numSockets > 0)
+		m_numSockets--;
+}
+
+const std::vector<Reactor::Event>& Reactor::Wait(int timeoutMs)
+{
+	m_events.clear();
+
+	// Grow the event buffer so a busy server doesn't need several waits to see every ready socket
+	if (m_numSockets > m_epollEvents.size())
+		m_epollEvents.resize(m_numSockets);
+
+	int n = epoll_wait(m_epollFd, m_epollEvents.data(), (int)m_epollEvents.size(), timeoutMs);
+	if (n < 0) {
+		if (errno != EINTR)
+			LOG(LogLevel::kWarning, "epoll_wait() failed (errno=%d)", errno);
+		return m_events;
+	}
+
+	for (int i = 0; i < n; ++i) {
+		const struct epoll_event& ev = m_epollEvents[i];
+		int flags = 0;
+
+		if (ev.data.ptr == &m_wakeFd) {
+			uint64_t value;
+			while (read(m_wakeFd, &value, sizeof(value)) > 0)
+				;
+
+			continue;
+		}
+
+		if (ev.events & EPOLLIN)
+			flags |= kReadable;
+		if (ev.events & EPOLLOUT)
+			flags |= kWritable;
+		if (ev.events & (EPOLLHUP | EPOLLERR))
+			flags |= kHangup;
+
+		m_events.push_back({ ev.data.ptr, flags });
+	}
+
+	return m_events;
+}
+
+void Reactor::Wakeup()
+{
+	uint64_t value = 1;
+
+	// EAGAIN means the counter is already set, the waiter wakes up either way
+	if (write(m_wakeFd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+		LOG(LogLevel::kWarning, "Failed to wake reactor (errno=%d)", errno);
+}
+
+#else
+
+Reactor::Reactor()
+{
+}
+
+Reactor::~Reactor()
+{
+}
+
+bool Reactor::Init()
+{
+	return true;
+}
+
+bool Reactor::Add(sf::SocketHandle handle, void* data, bool writable, bool readable)
+{
+	m_sockets[handle] = { data, (readable ? kReadable : 0) | (writable ? kWritable : 0) };
+	return true;
+}
+
+bool Reactor::Modify(sf::SocketHandle handle, void* data, bool writable, bool readable)
+{
+	return Add(handle, data, writable, readable);
+}
+
+void Reactor::Remove(sf::SocketHandle handle)
+{
+	m_sockets.erase(handle);
+}
+
+const std::vector<Reactor::Event>& Reactor::Wait(int timeoutMs)
+{
+	m_events.clear();
+
+	if (timeoutMs > 0)
+		sf::sleep(sf::milliseconds(timeoutMs));
+
+	for (auto& obj : m_sockets)
+		m_events.push_back(obj.second);
+
+	return m_events;
+}
+
+void Reactor::Wakeup()
+{
+	// Wait() only ever sleeps for its timeout here
+}
+
+#endif
@@ -0,0 +1,55 @@
+﻿#ifndef REACTOR_H_
+#define REACTOR_H_
+
+#include <vector>
+
+#ifdef __linux__
+	#include <sys/epoll.h>
+#else
+	#include <map>
+#endif
+
+#include <SFML/Network.hpp>
+
+// Waits on socket readiness so idle sockets cost nothing per tick
+// Uses epoll on Linux; elsewhere every registered socket is reported as ready (old polling behavior)
+class Reactor {
+public:
+	enum EventFlags { kReadable = 1 << 0, kWritable = 1 << 1, kHangup = 1 << 2 };
+
+	struct Event {
+		void* data;
+		int flags;
+	};
+
+	Reactor();
+
+	~Reactor();
+
+	bool Init();
+
+	// Sockets that aren't readable are left alone until modified again, that's how reading is paused
+	bool Add(sf::SocketHandle handle, void* data, bool writable=false, bool readable=true);
+	bool Modify(sf::SocketHandle handle, void* data, bool writable, bool readable=true);
+	void Remove(sf::SocketHandle handle);
+
+	// Blocks up to timeoutMs (0 returns immediately, -1 waits indefinitely); returned events are valid until the next call
+	const std::vector<Event>& Wait(int timeoutMs);
+
+	// Makes a Wait() on another thread return early, safe to call from any thread
+	void Wakeup();
+
+private:
+#ifdef __linux__
+	int m_epollFd;
+	int m_wakeFd; // eventfd, never reported as an event
+	size_t m_numSockets;
+	std::vector<struct epoll_event> m_epollEvents;
+#else
+	std::map<sf::SocketHandle, Event> m_sockets;
+#endif
+
+	std::vector<Event> m_events;
+};
+
+#endif // REACTOR_H_
@@ -0,0 +1,18 @@
+﻿#ifndef SOCKET_H_
+#define SOCKET_H_
+
+#include <SFML/Network.hpp>
+
+// SFML keeps the native handle protected, these expose it so sockets can be registered with the reactor
+
+class Socket : public sf::TcpSocket {
+public:
+	using sf::TcpSocket::getHandle;
+};
+
+class Listener : public sf::TcpListener {
+public:
+	using sf::TcpListener::getHandle;
+};
+
+#endif // SOCKET_H_
@@ -9,6 +9,7 @@
 #include <openssl/md5.h>
 
 #include <iostream>
+#include <algorithm>
 #include <stdexcept>
 
 #include <zlib.h>
@@ -27,10 +28,11 @@
 #include "Commands/TeleportCommand.hpp"
 #include "Commands/SummonCommand.hpp"
 #include "Commands/OpCommand.hpp"
+#include "Commands/StatsCommand.hpp"
 
 Server* Server::m_thisPtr = nullptr;
 
-Server::Server() : reloadPluginsFlag(false), m_running(true)
+Server::Server() : reloadPluginsFlag(false), m_spareSocket(nullptr), m_running(true)
 {
 	m_port = 25565;
 	m_version = 0x07;
@@ -39,15 +41,25 @@ Server::Server() : reloadPluginsFlag(false), m_running(true)
 	m_serverHeartbeat = false;
 	m_serverPublic = false;
 	m_serverVerifyNames = false;
+	m_packetBudget = kDefaultPacketBudget;
+	m_positionRate = kDefaultPositionRate;
 }
 
 Server::~Server()
 {
+	// Threads go first, they may still be using the sockets
+	m_ioThreads.clear();
+
 	for (auto& obj : m_clients)
 		delete obj;
 
+	for (auto& obj : m_releasingClients)
+		delete obj;
+
 	for (auto& obj : m_worlds)
 		delete obj.second;
+
+	delete m_spareSocket;
 }
 
 void Server::FreeInstance()
@@ -64,6 +76,8 @@ void Server::Init()
 	sf::err().rdbuf(nullptr);
 
 	bool debug = true;
+	int ioThreads = 0;
+	std::string heartbeatUrl = "http://www.classicube.net/server/heartbeat";
 
 	try {
 		boost::property_tree::ptree pt;
@@ -73,10 +87,21 @@ void Server::Init()
 		m_serverMotd = pt.get<std::string>("Server.motd");
 		m_port = pt.get<unsigned short>("Server.port");
 		m_serverHeartbeat = pt.get<bool>("Server.heartbeat");
+		heartbeatUrl = pt.get<std::string>("Server.heartbeat_url", heartbeatUrl);
 		m_serverPublic = pt.get<bool>("Server.public");
 		m_maxClients = pt.get<int>("Server.max_users");
 		m_serverVerifyNames = pt.get<bool>("Server.verify_names");
 		debug = pt.get<bool>("Server.debug");
+		m_packetBudget = pt.get<int>("Server.packet_budget", kDefaultPacketBudget);
+		m_positionRate = std::max(1, std::min(1000, pt.get<int>("Server.position_rate", kDefaultPositionRate)));
+
+		m_egress.SetRate(pt.get<size_t>("Server.egress_rate", 0));
+		Client::SetQueueLimit(pt.get<size_t>("Server.client_queue_limit", Client::kDefaultQueueLimit));
+		ioThreads = std::max(0, pt.get<int>("Server.io_threads", 0));
+
+		std::string compressionLevel = pt.get<std::string>("Server.compression_level", "adaptive");
+		if (!m_compressionController.SetPolicy(compressionLevel))
+			LOG(LogLevel::kWarning, "Invalid compression_level '%s', using adaptive", compressionLevel.c_str());
 	} catch (std::runtime_error& e) {
 		LOG(LogLevel::kWarning, "%s", e.what());
 	}
@@ -91,11 +116,36 @@ void Server::Init()
 
 	m_listener.setBlocking(false);
 
+	if (!m_reactor.Init()) {
+		LOG(LogLevel::kError, "Failed to initialize network reactor");
+		exit(1);
+	}
+
+	m_reactor.Add(m_listener.getHandle(), &m_listener);
+
+	for (int i = 0; i < ioThreads; ++i) {
+		std::unique_ptr<IoThread> thread(new IoThread(m_reactor));
+
+		if (!thread->Start()) {
+			LOG(LogLevel::kWarning, "Failed to start I/O threads, doing network I/O on the main thread");
+			m_ioThreads.clear();
+			break;
+		}
+
+		m_ioThreads.push_back(std::move(thread));
+	}
+
+	if (!m_ioThreads.empty())
+		LOG(LogLevel::kInfo, "Started %d I/O threads", (int)m_ioThreads.size());
+
 	if (!m_serverVerifyNames)
 		LOG(LogLevel::kWarning, "Verify names is turned off! This is NOT secure and disabling it should only be necessary during server tests. After that, TURN IT BACK ON.");
 
 	m_salt = Utils::GetRandomSalt();
 
+	if (m_serverHeartbeat && !m_heartbeat.Start(heartbeatUrl))
+		m_serverHeartbeat = false;
+
 	SendHeartbeat();
 
 	if (boost::filesystem::exists("worlds")) {
@@ -150,6 +200,7 @@ void Server::LoadPlugins()
 	m_commandHandler.Register("tp", new TeleportCommand("tp"));
 	m_commandHandler.Register("summon", new SummonCommand("summon"));
 	m_commandHandler.Register("op", new OpCommand("op"));
+	m_commandHandler.Register("stats", new StatsCommand("stats"));
 
 	m_pluginHandler.LoadPlugin("plugins/core/init.lua"); // Load this first
 
@@ -184,7 +235,7 @@ void Server::ReloadPlugins()
 	LoadPlugins();
 }
 
-void Server::OnConnect(sf::TcpSocket *sock)
+void Server::OnConnect(Socket *sock)
 {
 	Client* client = new Client();
 
@@ -194,6 +245,17 @@ void Server::OnConnect(sf::TcpSocket *sock)
 
 	m_clients.push_back(client);
 
+	if (!m_ioThreads.empty()) {
+		// Pinned to the least busy thread for as long as it's connected
+		auto it = std::min_element(m_ioThreads.begin(), m_ioThreads.end(), [](const std::unique_ptr<IoThread>& a, const std::unique_ptr<IoThread>& b) {
+			return a->GetNumClients() < b->GetNumClients();
+		});
+
+		(*it)->AddClient(client);
+	} else if (!m_reactor.Add(sock->getHandle(), client)) {
+		client->active = false;
+	}
+
 	LOG(LogLevel::kDebug, "Client connected (%s)", client->GetIpString().c_str());
 }
 
@@ -450,14 +512,120 @@ void Server::HandlePacket(Client* client, uint8_t opcode)
 	}
 }
 
+void Server::AcceptConnections()
+{
+	// Drain the whole backlog; the spare socket is kept for next time if nothing is pending
+	while (true) {
+		if (m_spareSocket == nullptr) {
+			m_spareSocket = new Socket();
+			m_spareSocket->setBlocking(false);
+		}
+
+		if (m_listener.accept(*m_spareSocket) != sf::Socket::Done)
+			break;
+
+		OnConnect(m_spareSocket);
+		m_spareSocket = nullptr;
+	}
+}
+
+float Server::GetTickHeadroom()
+{
+	return 1.0f - std::min(1.0f, m_tickTime.asSeconds() * 1000.0f / kTickInterval);
+}
+
+int Server::GetNumLoadingClients()
+{
+	int count = 0;
+
+	for (auto& client : m_clients) {
+		if (client->IsLoading())
+			count++;
+	}
+
+	return count;
+}
+
+// Game thread end of the I/O threads: framed packets go into the client streams as if they had been read here
+void Server::ProcessIoEvents()
+{
+	IoThread::Event event;
+
+	for (auto& thread : m_ioThreads) {
+		thread->ReportMetrics();
+
+		while (thread->PollEvent(event)) {
+			Client* client = event.client;
+
+			switch (event.type) {
+			case IoThread::kEventFrame:
+				// The I/O thread never has more in flight than the stream can take
+				if (client->active) {
+					client->stream.push(event.data, event.size);
+					SetReady(client);
+				}
+				break;
+			case IoThread::kEventClosed:
+				client->active = false;
+				break;
+			case IoThread::kEventReleased:
+				m_releasingClients.erase(std::remove(m_releasingClients.begin(), m_releasingClients.end(), client), m_releasingClients.end());
+				delete client;
+				break;
+			default:
+				break;
+			}
+		}
+	}
+}
+
+void Server::FlushClients()
+{
+	for (auto& client : m_clients) {
+		// Inactive clients still get a last flush, that's how kick messages go out
+		if (!client->writable || !client->HasQueuedPackets())
+			continue;
+
+		size_t allowance = m_egress.GetAllowance(client);
+		if (allowance == 0)
+			continue;
+
+		IoChannel* channel = client->GetIoChannel();
+		if (channel != nullptr) {
+			size_t handed = client->HandOffPackets(allowance);
+
+			if (handed > 0) {
+				m_egress.OnSent(client, handed);
+				channel->thread->Flush(client);
+			}
+
+			continue;
+		}
+
+		m_egress.OnSent(client, client->ProcessPacketsInQueue(allowance));
+
+		// Socket filled up, ask the reactor to tell us when it drains
+		if (!client->writable)
+			m_reactor.Modify(client->stream.socket->getHandle(), client, true);
+	}
+}
+
+// Fixed cadence work, the network is handled in between by ProcessNetwork()
 bool Server::Tick()
 {
+	sf::Clock tickClock;
+
+	m_tickTime = m_busyTime;
+	m_busyTime = sf::Time::Zero;
+
 	// Send heartbeat to server list
 	if (m_heartbeatClock.getElapsedTime().asSeconds() >= kHeartbeatTime) {
 		SendHeartbeat();
 		m_heartbeatClock.restart();
 	}
 
+	ProcessHeartbeat();
+
 	if (reloadPluginsFlag) {
 		ReloadPlugins();
 		reloadPluginsFlag = false;
@@ -470,29 +638,123 @@ bool Server::Tick()
 	for (auto& obj : m_worlds)
 		obj.second->Tick();
 
-	// Accept new sockets
-	sf::TcpSocket* socket = new sf::TcpSocket();
+	m_busyTime += tickClock.getElapsedTime();
 
-	socket->setBlocking(false);
+	// Whatever the ticks queued goes out now
+	ProcessNetwork(0);
+	SweepClients();
 
-	if (m_listener.accept(*socket) == sf::Socket::Done)
-		OnConnect(socket);
-	else
-		delete socket;
+	return m_running;
+}
 
-	// Update clients
-	auto it = m_clients.begin();
-	while(it != m_clients.end()) {
-		sf::Socket::Status status = (*it)->stream.poll();
-		if (status == sf::Socket::Disconnected)
-			(*it)->active = false;
+void Server::SetReady(Client* client)
+{
+	if (client->ready)
+		return;
+
+	client->ready = true;
+	m_readyClients.push_back(client);
+}
+
+// Handles packets as soon as they arrive, only the clients that have some are looked at; sending waits for the tick
+void Server::ProcessNetwork(int timeoutMs)
+{
+	// Clients that ran out of packet budget still have input waiting
+	if (!m_readyClients.empty())
+		timeoutMs = 0;
+
+	const std::vector<Reactor::Event>& events = m_reactor.Wait(timeoutMs);
+
+	sf::Clock busyClock;
+
+	// Only sockets the reactor reports as ready are touched
+	for (auto& event : events) {
+		if (event.data == &m_listener) {
+			AcceptConnections();
+			continue;
+		}
+
+		Client* client = static_cast<Client*>(event.data);
+
+		// Hangups are handled by reading, poll() reports the disconnect
+		if (event.flags & (Reactor::kReadable | Reactor::kHangup)) {
+			client->readable = true;
+			SetReady(client);
+		}
+
+		if ((event.flags & Reactor::kWritable) && !client->writable) {
+			client->writable = true;
+			m_reactor.Modify(client->stream.socket->getHandle(), client, false);
+		}
+	}
+
+	ProcessIoEvents();
+
+	std::vector<Client*> ready;
+	ready.swap(m_readyClients);
+
+	for (auto& client : ready) {
+		client->ready = false;
+
+		size_t buffered = client->stream.count;
+
+		if (client->readable) {
+			client->readable = false;
+
+			sf::Socket::Status status = client->stream.poll();
+			if (status == sf::Socket::Disconnected)
+				client->active = false;
+		}
+
+		// Dispatch every complete packet in the stream, the budget keeps one busy client from starving the rest
+		int budget = m_packetBudget;
+		while (client->active && budget > 0 && client->stream.count > 0) {
+			uint8_t opcode = client->stream.front();
+			size_t size = Protocol::GetClientPacketSize(opcode);
+
+			// Unknown opcodes still go to HandlePacket so the client gets kicked
+			if (size != 0 && client->stream.count < size)
+				break;
+
+			HandlePacket(client, opcode);
+			budget--;
+		}
+
+		// Picked up again on the next pass
+		if (budget == 0 && client->active && client->stream.count > 0)
+			SetReady(client);
 
-		// If any data is in stream, pass HandlePacket the opcode (first byte of buffer)
-		if ((*it)->stream.count > 0)
-			HandlePacket(*it, (*it)->stream.buf[0]);
+		// Lets the I/O thread frame more once there's room again
+		if (client->GetIoChannel() != nullptr)
+			client->GetIoChannel()->thread->OnConsumed(client, buffered - client->stream.count);
+	}
+
+	m_busyTime += busyClock.getElapsedTime();
+}
 
-		(*it)->ProcessPacketsInQueue();
+// Once per tick, everything that has to look at every client: kicks, sending and removing the disconnected ones
+void Server::SweepClients()
+{
+	sf::Clock busyClock;
 
+	// Clients whose queue went past the limit already lost their backlog, only the kick is left to send
+	for (auto& client : m_clients) {
+		if (client->active && client->IsTooSlow()) {
+			LOG(LogLevel::kInfo, "Kicking %s, send queue went past the limit", client->GetIpString().c_str());
+			KickClient(client, "Too slow");
+		}
+	}
+
+	// Flushed after every client was handled so packets they caused go out this tick
+	m_egress.Schedule(m_clients);
+	FlushClients();
+
+	// Second pass hands out what clients with nothing left to send didn't use
+	if (m_egress.Redistribute(m_clients))
+		FlushClients();
+
+	auto it = m_clients.begin();
+	while(it != m_clients.end()) {
 		// Deletes inactive clients and sends despawn packet to all active clients if necessary
 		if (!(*it)->active) {
 			// Client removed here because DespawnClient() would send to this inactive client as well
@@ -500,6 +762,14 @@ bool Server::Tick()
 
 			it = m_clients.erase(it);
 
+			if (oldClient->ready)
+				m_readyClients.erase(std::remove(m_readyClients.begin(), m_readyClients.end(), oldClient), m_readyClients.end());
+
+			if (oldClient->GetIoChannel() != nullptr)
+				oldClient->GetIoChannel()->thread->RemoveClient(oldClient);
+			else
+				m_reactor.Remove(oldClient->stream.socket->getHandle());
+
 			std::string name = oldClient->GetName();
 			std::string ipString = oldClient->GetIpString();
 
@@ -525,16 +795,23 @@ bool Server::Tick()
 				LOG(LogLevel::kInfo, "Client disconnected (%s)", ipString.c_str());
 			}
 
-			delete oldClient;
+			if (oldClient->GetIoChannel() != nullptr)
+				m_releasingClients.push_back(oldClient);
+			else
+				delete oldClient;
 		} else {
 			++it;
 		}
 	}
 
-	return m_running;
+	// One wakeup per thread for everything handed off in this pass
+	for (auto& thread : m_ioThreads)
+		thread->Wake();
+
+	m_busyTime += busyClock.getElapsedTime();
 }
 
-// Doesn't use https
+// Only queues it, the heartbeat worker does the request
 void Server::SendHeartbeat()
 {
 	// Setting to disable heartbeat in config file
@@ -546,19 +823,25 @@ void Server::SendHeartbeat()
 
 	std::snprintf(postData, sizeof(postData), "public=%s&max=%d&users=%d&port=%hu&version=%d&salt=%s&name=%s&software=%s", isPublic.c_str(), m_maxClients, m_numClients, m_port, m_version, m_salt.c_str(), m_serverName.c_str(), software.c_str());
 
-	sf::Http http;
-	http.setHost("http://www.classicube.net/");
-
-	sf::Http::Request request;
+	m_heartbeat.Send(postData);
+}
 
-	request.setMethod(sf::Http::Request::Post);
-	request.setUri("/server/heartbeat");
-	request.setBody(postData);
+void Server::ProcessHeartbeat()
+{
+	Heartbeat::Result result;
 
-	sf::Http::Response response = http.sendRequest(request);
+	while (m_heartbeat.PollResult(result)) {
+		if (!result.ok) {
+			LOG(LogLevel::kWarning, "Failed to send heartbeat (status %d, %d attempts)", result.status, result.attempts);
+			continue;
+		}
 
-	if (response.getStatus() != sf::Http::Response::Status::Ok)
-		LOG(LogLevel::kWarning, "Failed to send heartbeat");
+		// The list server answers with the play URL, only worth logging when it changes
+		if (result.body != m_serverUrl) {
+			m_serverUrl = result.body;
+			LOG(LogLevel::kInfo, "Heartbeat accepted: %s", m_serverUrl.c_str());
+		}
+	}
 }
 
 void Server::KickClient(Client* client, std::string reason)
@@ -577,7 +860,7 @@ void Server::KickClient(Client* client, std::string reason)
 }
 
 // FIXME: This is temporary, it works for the most part but is horribly messy and inefficient
-void Server::SendWrappedMessageB(Client* client, std::string message)
+void Server::SendWrappedMessageB(const std::vector<Client*>& clients, std::string message)
 {
 	int max = 64;
 	int pos = 0;
@@ -612,14 +895,20 @@ void Server::SendWrappedMessageB(Client* client, std::string message)
 			}
 		}
 
-		Protocol::SendMessage(client, partialMessage);
+		Protocol::SendMessage(clients, partialMessage);
 
 		pos += count;
 	}
 }
 
-// FIXME: This is temporary, it works for the most part but is horribly messy and inefficient
 void Server::SendWrappedMessage(Client* client, std::string message)
+{
+	SendWrappedMessage(std::vector<Client*>{ client }, message);
+}
+
+// FIXME: This is temporary, it works for the most part but is horribly messy and inefficient
+// Wraps once and queues the same packets to every client
+void Server::SendWrappedMessage(const std::vector<Client*>& clients, std::string message)
 {
 	std::vector<std::string> tokens;
 
@@ -676,9 +965,9 @@ void Server::SendWrappedMessage(Client* client, std::string message)
 
 	for (auto& obj : messages) {
 		if (obj.size() > MAX_SIZE)
-			SendWrappedMessageB(client, obj);
+			SendWrappedMessageB(clients, obj);
 		else
-			Protocol::SendMessage(client, obj);
+			Protocol::SendMessage(clients, obj);
 	}
 }
 
@@ -689,14 +978,12 @@ void Server::SendSystemMessage(Client* client, std::string message)
 
 void Server::SendSystemWideMessage(std::string message)
 {
-	for (auto& client : m_clients)
-		SendSystemMessage(client, message);
+	SendWrappedMessage(m_clients, "&e[SYSTEM]: " + message);
 }
 
 void Server::BroadcastMessage(std::string message)
 {
-	for (auto& client : m_clients)
-		SendWrappedMessage(client, message);
+	SendWrappedMessage(m_clients, message);
 }
 
 Client* Server::GetClientByName(std::string name, bool exact)
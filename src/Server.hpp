@@ -8,19 +8,29 @@
 #include <vector>
 #include <map>
 #include <functional>
+#include <algorithm>
+#include <memory>
 
 #include <SFML/Network.hpp>
 #include  <boost/signals2.hpp>
 
 #include "Network/Protocol.hpp"
+#include "Network/Reactor.hpp"
+#include "Network/EgressScheduler.hpp"
+#include "Network/IoThread.hpp"
+#include "Network/Heartbeat.hpp"
+#include "Network/Socket.hpp"
 #include "Client.hpp"
 #include "World.hpp"
 #include "Position.hpp"
 #include "CommandHandler.hpp"
 #include "LuaPlugins/LuaPluginHandler.hpp"
+#include "Utils/CompressionController.hpp"
 
 class Server {
 public:
+	enum { kTickInterval = 33 /* ms */ };
+
 	// FIXME: Temporary
 	bool reloadPluginsFlag;
 
@@ -45,22 +55,33 @@ public:
 	std::vector<Client*> GetClients() { return m_clients; }
 	std::map<std::string, World*> GetWorlds() { return m_worlds; }
 	std::string GetName() { return "&bMCHawk"; }
+	int GetPositionInterval() { return std::max<int>(kTickInterval, 1000 / m_positionRate); } // ms between position broadcasts, at least a tick
+	CompressionController& GetCompressionController() { return m_compressionController; }
+	float GetTickHeadroom(); // Unused fraction of the last tick interval
+	int GetNumLoadingClients();
 
 	void LoadPlugins();
 	void ReloadPlugins();
 
-	void OnConnect(sf::TcpSocket *sock);
+	void OnConnect(Socket *sock);
 	void OnAuth(Client* client, struct Protocol::cauthp clientAuth);
 	void OnMessage(Client* client, struct Protocol::cmsgp clientMsg);
 
 	void HandlePacket(Client* client, uint8_t opcode);
+	void AcceptConnections();
+	void ProcessIoEvents();
+	void FlushClients();
 	bool Tick();
+	void ProcessNetwork(int timeoutMs); // Waits up to timeoutMs for sockets to become ready
+	void SweepClients();
 
 	void SendHeartbeat();
+	void ProcessHeartbeat();
 
 	// Client helper functions
 	void KickClient(Client* client, std::string reason="");
-	static void SendWrappedMessageB(Client* client, std::string message);
+	static void SendWrappedMessageB(const std::vector<Client*>& clients, std::string message);
+	static void SendWrappedMessage(const std::vector<Client*>& clients, std::string message);
 	static void SendWrappedMessage(Client* client, std::string message);
 	void SendSystemMessage(Client* client, std::string message);
 	void SendSystemWideMessage(std::string message);
@@ -78,10 +99,19 @@ public:
 
 private:
 	enum { kHeartbeatTime = 60 /* seconds */, kSaveTime = 600 /* seconds */ };
+	enum { kDefaultPacketBudget = 32 /* packets per client per pass */, kDefaultPositionRate = 20 /* updates per second */ };
 
 	static Server* m_thisPtr; // Singleton
 
-	sf::TcpListener m_listener;
+	Listener m_listener;
+	Socket* m_spareSocket; // Reused for accept() until a connection is actually pending
+
+	Reactor m_reactor;
+	EgressScheduler m_egress;
+
+	// Empty unless io_threads is set, then they own every client socket and the reactor only has the listener
+	std::vector<std::unique_ptr<IoThread>> m_ioThreads;
+	std::vector<Client*> m_releasingClients; // Removed, deleted once their I/O thread lets go of them
 
 	unsigned short m_port;
 
@@ -99,14 +129,25 @@ private:
 	bool m_serverHeartbeat;
 	bool m_serverPublic;
 	bool m_serverVerifyNames;
+	int m_packetBudget;
+	int m_positionRate;
+
+	CompressionController m_compressionController;
 
 	std::vector<Client*> m_clients;
+	std::vector<Client*> m_readyClients; // Read from or framed for since the last pass, or still past their budget
 
 	CommandHandler m_commandHandler;
 
+	Heartbeat m_heartbeat;
+	std::string m_serverUrl; // Last answer from the list server
 	sf::Clock m_heartbeatClock;
+	sf::Time m_tickTime; // Time spent working (not waiting) during the last tick interval
+	sf::Time m_busyTime; // Same, for the current interval
 
 	std::map<std::string, World*> m_worlds;
+
+	void SetReady(Client* client);
 };
 
 #endif // SERVER_H_
@@ -0,0 +1,54 @@
+﻿#include "CompressionController.hpp"
+
+#include <algorithm>
+#include <zlib.h>
+
+CompressionController::CompressionController() : m_level(kAdaptive)
+{
+}
+
+bool CompressionController::SetPolicy(const std::string& policy)
+{
+	if (policy == "adaptive") {
+		m_level = kAdaptive;
+		return true;
+	}
+
+	if (policy.size() == 1 && policy[0] >= '0' && policy[0] <= '9') {
+		m_level = policy[0] - '0';
+		return true;
+	}
+
+	return false;
+}
+
+std::string CompressionController::GetPolicy() const
+{
+	if (m_level == kAdaptive)
+		return "adaptive";
+
+	return std::to_string(m_level);
+}
+
+int CompressionController::ChooseLevel(float headroom, int joins, size_t mapSize) const
+{
+	if (m_level != kAdaptive)
+		return m_level;
+
+	// Tick is nearly used up or it's a join storm, every joiner waits on this
+	if (headroom < 0.25f || joins >= 8)
+		return Z_BEST_SPEED;
+
+	int level = Z_BEST_COMPRESSION;
+
+	if (headroom < 0.5f || joins >= 4)
+		level = 4;
+	else if (joins >= 2)
+		level = 6;
+
+	// Best compression on huge maps holds up the joiner for little gain
+	if (mapSize >= kLargeMapSize)
+		level = std::min(level, 6);
+
+	return level;
+}
@@ -0,0 +1,29 @@
+﻿#ifndef COMPRESSIONCONTROLLER_H_
+#define COMPRESSIONCONTROLLER_H_
+
+#include <cstddef>
+
+#include <string>
+
+// Picks the deflate level for each map compression: fast while the server is busy or players are
+// flooding in, best compression when it's idle. Operators can pin a level instead.
+class CompressionController {
+public:
+	enum { kAdaptive = -1 };
+
+	CompressionController();
+
+	// "adaptive" or a zlib level from 0 to 9
+	bool SetPolicy(const std::string& policy);
+	std::string GetPolicy() const;
+
+	// headroom is the unused fraction of the last tick, joins the number of clients loading a map
+	int ChooseLevel(float headroom, int joins, size_t mapSize) const;
+
+private:
+	enum { kLargeMapSize = 16 * 1024 * 1024 /* bytes */ };
+
+	int m_level; // kAdaptive or the pinned level
+};
+
+#endif // COMPRESSIONCONTROLLER_H_
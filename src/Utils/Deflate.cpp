@@ -0,0 +1,129 @@
+﻿#include "Deflate.hpp"
+
+#include <cstdlib>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <zlib.h>
+
+#include "Logger.hpp"
+
+size_t Deflate::GetNumSegments(size_t bufferSize)
+{
+	return std::max<size_t>(1, (bufferSize + kSegmentSize - 1) / kSegmentSize);
+}
+
+void Deflate::CompressSegment(const uint8_t* buffer, size_t size, bool last, int level, Segment& segment)
+{
+	z_stream strm;
+	strm.zalloc = Z_NULL;
+	strm.zfree = Z_NULL;
+	strm.opaque = Z_NULL;
+
+	// Negative window bits for raw deflate, the gzip wrapper is written once for all segments
+	int ret = deflateInit2(&strm, level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+	if (ret != Z_OK) {
+		LOG(LogLevel::kError, "Zlib error: deflateInit2()");
+		std::exit(1);
+	}
+
+	// Room for the flush marker on top of the bound
+	segment.data.resize(deflateBound(&strm, (uLong)size) + 16);
+
+	strm.avail_in = (uInt)size;
+	strm.next_in = (Bytef*)buffer;
+
+	int flush = last ? Z_FINISH : Z_FULL_FLUSH;
+
+	do {
+		if (strm.total_out == segment.data.size())
+			segment.data.resize(segment.data.size() * 2);
+
+		strm.avail_out = (uInt)(segment.data.size() - strm.total_out);
+		strm.next_out = (Bytef*)(segment.data.data() + strm.total_out);
+
+		ret = deflate(&strm, flush);
+		if (ret == Z_STREAM_ERROR) {
+			LOG(LogLevel::kError, "Zlib error: deflate()");
+			std::exit(1);
+		}
+	} while (last ? (ret != Z_STREAM_END) : (strm.avail_out == 0));
+
+	segment.data.resize(strm.total_out);
+	segment.crc = crc32(crc32(0, Z_NULL, 0), buffer, (uInt)size);
+	segment.rawSize = size;
+
+	deflateEnd(&strm);
+}
+
+void Deflate::CompressSegments(const std::vector<SegmentInput>& inputs, int level, std::vector<SharedSegment>& outSegments)
+{
+	size_t numSegments = inputs.size();
+
+	std::vector<Segment> segments(numSegments);
+
+	// Workers pull the next segment until none are left
+	std::atomic<size_t> next(0);
+
+	auto worker = [&]() {
+		size_t i;
+		while ((i = next++) < numSegments)
+			CompressSegment(inputs[i].data.data(), inputs[i].data.size(), inputs[i].last, level, segments[i]);
+	};
+
+	size_t numThreads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), numSegments);
+
+	// The calling thread does its share too
+	std::vector<std::thread> threads;
+	for (size_t i = 1; i < numThreads; ++i)
+		threads.emplace_back(worker);
+
+	worker();
+
+	for (auto& thread : threads)
+		thread.join();
+
+	outSegments.clear();
+	for (auto& segment : segments)
+		outSegments.push_back(std::make_shared<Segment>(std::move(segment)));
+}
+
+void Deflate::WriteGzip(const std::vector<SharedSegment>& segments, std::vector<uint8_t>& out)
+{
+	// Magic, deflate, no flags, no mtime, no extra flags, unknown OS
+	static const uint8_t header[] = { 0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff };
+
+	size_t compSize = sizeof(header) + 8;
+	for (auto& segment : segments)
+		compSize += segment->data.size();
+
+	out.clear();
+	out.reserve(compSize);
+	out.insert(out.end(), header, header + sizeof(header));
+
+	uLong crc = crc32(0, Z_NULL, 0);
+	uint32_t rawSize = 0; // ISIZE is the size modulo 2^32
+
+	for (auto& segment : segments) {
+		out.insert(out.end(), segment->data.begin(), segment->data.end());
+
+		crc = crc32_combine(crc, segment->crc, (z_off_t)segment->rawSize);
+		rawSize += (uint32_t)segment->rawSize;
+	}
+
+	// Trailer is little endian
+	for (int i = 0; i < 4; ++i)
+		out.push_back((uint8_t)(crc >> (i * 8)));
+	for (int i = 0; i < 4; ++i)
+		out.push_back((uint8_t)(rawSize >> (i * 8)));
+}
+
+uint32_t Deflate::ReadGzipCrc(const std::vector<uint8_t>& gzip)
+{
+	if (gzip.size() < 8)
+		return 0;
+
+	size_t offset = gzip.size() - 8;
+
+	return (uint32_t)gzip[offset] | ((uint32_t)gzip[offset + 1] << 8) | ((uint32_t)gzip[offset + 2] << 16) | ((uint32_t)gzip[offset + 3] << 24);
+}
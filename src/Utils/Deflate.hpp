@@ -0,0 +1,42 @@
+﻿#ifndef DEFLATE_H_
+#define DEFLATE_H_
+
+#include <cstdint>
+#include <cstddef>
+
+#include <vector>
+#include <memory>
+
+// Gzip compression split into independently deflated segments, so large maps can be compressed on every core
+// Segments end on a full flush, which lets their raw deflate data be concatenated into a single stream
+namespace Deflate {
+
+enum { kSegmentSize = 256 * 1024 };
+
+struct Segment {
+	std::vector<uint8_t> data; // Raw deflate data
+	uint32_t crc; // CRC32 of the uncompressed segment
+	size_t rawSize;
+};
+
+typedef std::shared_ptr<const Segment> SharedSegment;
+
+struct SegmentInput {
+	std::vector<uint8_t> data; // Copy of the uncompressed segment
+	bool last; // The last segment closes the deflate stream
+};
+
+size_t GetNumSegments(size_t bufferSize);
+
+void CompressSegment(const uint8_t* buffer, size_t size, bool last, int level, Segment& segment);
+void CompressSegments(const std::vector<SegmentInput>& inputs, int level, std::vector<SharedSegment>& outSegments);
+
+// Wraps the segments in a gzip header and trailer, combining their CRCs
+void WriteGzip(const std::vector<SharedSegment>& segments, std::vector<uint8_t>& out);
+
+// CRC32 of the uncompressed data, read from the gzip trailer
+uint32_t ReadGzipCrc(const std::vector<uint8_t>& gzip);
+
+} // namespace Deflate
+
+#endif // DEFLATE_H_
@@ -0,0 +1,31 @@
+﻿#include "Metrics.hpp"
+
+Metrics* Metrics::m_thisPtr = nullptr;
+
+Metrics* Metrics::GetMetrics()
+{
+	if (m_thisPtr == nullptr)
+		m_thisPtr = new Metrics();
+
+	return m_thisPtr;
+}
+
+void Metrics::Add(const std::string& name, int64_t amount)
+{
+	m_counters[name] += amount;
+}
+
+void Metrics::Set(const std::string& name, int64_t value)
+{
+	m_counters[name] = value;
+}
+
+int64_t Metrics::Get(const std::string& name)
+{
+	auto i = m_counters.find(name);
+
+	if (i == m_counters.end())
+		return 0;
+
+	return i->second;
+}
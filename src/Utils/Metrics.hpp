@@ -0,0 +1,26 @@
+﻿#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <cstdint>
+
+#include <string>
+#include <map>
+
+// Named server-wide counters, shown in game with /stats
+class Metrics {
+public:
+	static Metrics* GetMetrics();
+
+	void Add(const std::string& name, int64_t amount=1);
+	void Set(const std::string& name, int64_t value);
+	int64_t Get(const std::string& name);
+
+	const std::map<std::string, int64_t>& GetCounters() const { return m_counters; }
+
+private:
+	static Metrics* m_thisPtr; // Singleton
+
+	std::map<std::string, int64_t> m_counters;
+};
+
+#endif // METRICS_H_
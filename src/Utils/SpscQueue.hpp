@@ -0,0 +1,86 @@
+﻿#ifndef SPSCQUEUE_H_
+#define SPSCQUEUE_H_
+
+#include <cstddef>
+
+#include <atomic>
+#include <vector>
+#include <utility>
+
+// Bounded lock-free ring for exactly one producer thread and one consumer thread
+// Each side caches the other's index so most calls touch only their own cache line
+template <typename T>
+class SpscQueue {
+public:
+	explicit SpscQueue(size_t capacity) : m_buffer(RoundUp(capacity)), m_mask(m_buffer.size() - 1), m_head(0), m_tailCache(0), m_tail(0), m_headCache(0)
+	{
+	}
+
+	// Producer side, false if the queue is full; the item is only moved from if it was queued
+	bool Push(T&& item)
+	{
+		size_t tail = m_tail.load(std::memory_order_relaxed);
+
+		if (tail - m_headCache == m_buffer.size()) {
+			m_headCache = m_head.load(std::memory_order_acquire);
+
+			if (tail - m_headCache == m_buffer.size())
+				return false;
+		}
+
+		m_buffer[tail & m_mask] = std::move(item);
+		m_tail.store(tail + 1, std::memory_order_release);
+
+		return true;
+	}
+
+	// Consumer side, false if the queue is empty
+	bool Pop(T& item)
+	{
+		size_t head = m_head.load(std::memory_order_relaxed);
+
+		if (head == m_tailCache) {
+			m_tailCache = m_tail.load(std::memory_order_acquire);
+
+			if (head == m_tailCache)
+				return false;
+		}
+
+		item = std::move(m_buffer[head & m_mask]);
+		m_head.store(head + 1, std::memory_order_release);
+
+		return true;
+	}
+
+	// Exact only when called by one of the two sides while the other is idle
+	bool IsEmpty() const { return m_head.load(std::memory_order_acquire) == m_tail.load(std::memory_order_acquire); }
+
+	size_t GetCapacity() const { return m_buffer.size(); }
+
+private:
+	enum { kCacheLineSize = 64 };
+
+	static size_t RoundUp(size_t capacity)
+	{
+		size_t size = 2;
+		while (size < capacity)
+			size <<= 1;
+
+		return size;
+	}
+
+	std::vector<T> m_buffer;
+	const size_t m_mask;
+
+	// Consumer's line
+	std::atomic<size_t> m_head;
+	size_t m_tailCache;
+	char m_padding0[kCacheLineSize];
+
+	// Producer's line
+	std::atomic<size_t> m_tail;
+	size_t m_headCache;
+	char m_padding1[kCacheLineSize];
+};
+
+#endif // SPSCQUEUE_H_
@@ -4,6 +4,13 @@
 #include <string>
 #include <openssl/rand.h>
 
+#ifdef __linux__
+	#include <fcntl.h>
+	#include <unistd.h>
+#elif _WIN32
+	#include <io.h>
+#endif
+
 namespace Utils {
 
 // http://www.cplusplus.com/reference/ctime/strftime/
@@ -85,4 +92,57 @@ std::string GetRandomSalt()
 	return salt;
 }
 
+bool SyncFile(std::FILE* fp)
+{
+	if (std::fflush(fp) != 0)
+		return false;
+
+#ifdef __linux__
+	return fdatasync(fileno(fp)) == 0;
+#elif _WIN32
+	return _commit(_fileno(fp)) == 0;
+#else
+	return true;
+#endif
+}
+
+bool WriteFileAtomically(const std::string& filename, const std::function<bool(std::FILE*)>& write)
+{
+	std::string tempFilename = filename + ".tmp";
+
+	std::FILE *fp = std::fopen(tempFilename.c_str(), "wb");
+	if (fp == nullptr)
+		return false;
+
+	// On disk before the rename makes it the file
+	bool ok = write(fp) && SyncFile(fp);
+
+	if (std::fclose(fp) != 0)
+		ok = false;
+
+#ifdef _WIN32
+	if (ok)
+		std::remove(filename.c_str()); // rename() doesn't replace existing files here
+#endif
+
+	if (!ok || std::rename(tempFilename.c_str(), filename.c_str()) != 0) {
+		std::remove(tempFilename.c_str());
+		return false;
+	}
+
+#ifdef __linux__
+	// The rename is only durable once the directory is
+	size_t slash = filename.rfind('/');
+	std::string directory = (slash == std::string::npos) ? "." : filename.substr(0, slash);
+
+	int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd >= 0) {
+		fsync(fd);
+		close(fd);
+	}
+#endif
+
+	return true;
+}
+
 } // namespace Utils
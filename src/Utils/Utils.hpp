@@ -2,8 +2,10 @@
 #define UTILS_H_
 
 #include <cstdint>
+#include <cstdio>
 
 #include <string>
+#include <functional>
 
 namespace Utils {
 
@@ -18,6 +20,13 @@ bool DistanceCheck(int32_t distance, int32_t x1, int32_t y1, int32_t z1, int32_t
 unsigned int GetRandomUInt(unsigned int n);
 std::string GetRandomSalt();
 
+// fflush() and then fdatasync(), or _commit() on Windows
+bool SyncFile(std::FILE* fp);
+
+// Runs write on a temporary file next to filename, syncs it and renames it over filename, so a crash at any point
+// leaves either the old file or the new one. write returns false if it failed, the old file is kept then.
+bool WriteFileAtomically(const std::string& filename, const std::function<bool(std::FILE*)>& write);
+
 } // namespace Utils
 
 #endif // UTILS_H_
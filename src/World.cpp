@@ -4,17 +4,21 @@
 #include "Network/Protocol.hpp"
 #include "Network/CPE.hpp"
 #include "Utils/Logger.hpp"
+#include "Utils/Metrics.hpp"
 #include "LuaPlugins/LuaPluginAPI.hpp"
 
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/ini_parser.hpp>
 
 // m_saveFlag set to true for new worlds so they'll be saved when autosave is set to true
-World::World(std::string name) : m_name(name), m_active(false), m_saveFlag(true)
+World::World(std::string name) : m_name(name), m_journalChecked(false), m_levelStreamChecked(false), m_levelStreamVersion(0), m_active(false), m_saveFlag(true)
 {
 	SetOption("build", "true", true);
 	SetOption("autosave", "false", true);
 	SetOption("autoload", "false", true);
+	SetOption("streamfile", "false", true);
+	SetOption("mmap", "false", true);
+	SetOption("journal", "true", true);
 }
 
 World::World() : World("")
@@ -22,8 +26,16 @@ World::World() : World("")
 
 }
 
+World::~World()
+{
+	if (m_saveJob != nullptr)
+		FinishSaveJob();
+}
+
 void World::Load(std::string filename)
 {
+	int replayed = 0;
+
 	try {
 		boost::property_tree::ptree pt;
 		boost::property_tree::ini_parser::read_ini(filename, pt);
@@ -42,6 +54,9 @@ void World::Load(std::string filename)
 		std::string autosave = pt.get<std::string>("Options.autosave");
 		std::string build = pt.get<std::string>("Options.build");
 		std::string autoload = pt.get<std::string>("Options.autoload");
+		std::string streamfile = pt.get<std::string>("Options.streamfile", "false");
+		std::string mmap = pt.get<std::string>("Options.mmap", "false");
+		std::string journal = pt.get<std::string>("Options.journal", "true");
 
 		m_name = name;
 		m_map.SetDimensions(Position(x_size, y_size, z_size));
@@ -50,16 +65,35 @@ void World::Load(std::string filename)
 		SetOption("autosave", autosave);
 		SetOption("build", build);
 		SetOption("autoload", autoload);
+		SetOption("streamfile", streamfile);
+		SetOption("mmap", mmap);
+		SetOption("journal", journal);
+
+		// Every change reaches the file through the mapping, worlds that aren't autosaved would keep them. The
+		// kernel writes pages back whenever it likes, only the journal can redo the ones a crash left half done.
+		bool mapped = (mmap == "true");
+		if (mapped && autosave != "true") {
+			LOG(LogLevel::kWarning, "World '%s' isn't autosaved, loading its map without mmap", m_name.c_str());
+			mapped = false;
+		} else if (mapped && journal != "true") {
+			LOG(LogLevel::kWarning, "World '%s' has no block journal, loading its map without mmap", m_name.c_str());
+			mapped = false;
+		}
+
+		m_map.SetMemoryMapped(mapped);
 
 		if (autoload == "true") {
 			m_map.Load();
 			SetActive(true);
+
+			// Changes made after the map was last saved
+			replayed = OpenJournal(true);
 		}
 	} catch (std::runtime_error& e) {
 		LOG(LogLevel::kWarning, "%s", e.what());
 	}
 
-	m_saveFlag = false;
+	m_saveFlag = (replayed > 0);
 }
 
 void World::Save()
@@ -100,18 +134,69 @@ void World::Save()
 		pt.add("Options.autoload", autoload);
 		pt.add("Options.autosave", autosave);
 		pt.add("Options.build", build);
+		pt.add("Options.streamfile", GetOption("streamfile"));
+		pt.add("Options.mmap", GetOption("mmap"));
+		pt.add("Options.journal", GetOption("journal"));
 
 		boost::property_tree::ini_parser::write_ini("worlds/" + m_name + ".ini", pt);
 	} catch (std::runtime_error& e) {
 		LOG(LogLevel::kWarning, "%s", e.what());
 	}
 
-	if (m_saveFlag) {
-		m_map.SaveToFile();
+	if (m_saveFlag && m_map.IsLoaded()) {
+		StartSaveJob();
 		m_saveFlag = false;
 	}
 }
 
+void World::StartSaveJob()
+{
+	// One at a time, only waits if a save is still being written when the next one starts
+	if (m_saveJob != nullptr)
+		FinishSaveJob();
+
+	auto start = std::chrono::steady_clock::now();
+
+	// Writing only the changed pages in place needs the journal to recover from a crash halfway through
+	auto save = std::make_shared<Map::SaveJob>(m_map.StartSave(m_map.GetFilename(), m_journal.IsOpen()));
+
+	Metrics::GetMetrics()->Set("map_snapshot_us", std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+
+	m_saveJob.reset(new SaveJob());
+	m_saveJob->save = save;
+	m_saveJob->journalPosition = m_journal.GetPosition();
+	m_saveJob->done = std::async(std::launch::async, [save]() {
+		Map::RunSave(*save);
+	});
+}
+
+void World::FinishSaveJob()
+{
+	std::unique_ptr<SaveJob> job = std::move(m_saveJob);
+
+	job->done.get();
+
+	// The old file is still there, the next save writes everything again
+	if (!m_map.FinishSave(*job->save)) {
+		m_saveFlag = true;
+		return;
+	}
+
+	if (m_journal.IsOpen())
+		m_journal.Compact(job->journalPosition);
+}
+
+// Only for worlds that are autosaved, others are meant to lose their changes on restart
+int World::OpenJournal(bool replay)
+{
+	m_journalChecked = true;
+
+	if (GetOption("journal") != "true" || GetOption("autosave") != "true" || !m_map.IsLoaded())
+		return 0;
+
+	return m_journal.Open(GetMapSideFilename(".journal"), m_map, replay);
+}
+
 void World::AddClient(Client* client)
 {
 	auto table = make_luatable(); // FIXME: Temporary, don't need this since we already have the strings
@@ -123,22 +208,66 @@ void World::AddClient(Client* client)
 
 	LOG(LogLevel::kDebug, "Player %s added to world '%s'", client->GetName().c_str(), m_name.c_str());
 
-	Protocol::SendMap(client, m_map);
-	Protocol::SpawnClient(client, m_spawnPosition, m_clients);
-	Protocol::SendClientsTo(client, m_clients);
-
 	client->SetWorld(this);
 
-	m_clients.push_back(client);
+	// A map still streaming from the previous world has to reach the client before the new one starts
+	client->FinishMapStream();
+	client->DropCoalescedBlocks();
+	client->CommitLanes();
+
+#ifdef __linux__
+	// The file has everything from LevelInit to LevelFinal, sent without copying it through the server
+	if (OpenLevelStream() && client->StreamFile(m_levelStream.GetFd(), m_levelStream.GetOffset(), m_levelStream.GetLength())) {
+		Protocol::SpawnClient(client, m_spawnPosition, m_clients);
+		Protocol::SendClientsTo(client, m_clients);
+
+		m_clients.push_back(client);
+
+		Metrics::GetMetrics()->Add("level_stream_joins", 1);
+		return;
+	}
+#endif
+
+	Protocol::SendLevelInit(client);
+	client->StartLoading();
+
+	auto compressed = m_map.GetCompressedBuffer();
+	if (compressed != nullptr) {
+		FinishJoin(client, compressed, std::vector<BlockChange>());
+		return;
+	}
+
+	// Compression happens off the tick, the client joins once the job is done
+	if (m_mapJob == nullptr)
+		StartMapJob();
+
+	m_mapJob->clients.push_back(client);
 }
 
 void World::RemoveClient(int8_t pid)
 {
+	if (m_mapJob != nullptr) {
+		auto& waiting = m_mapJob->clients;
+		for (auto iter = waiting.begin(); iter != waiting.end(); ++iter) {
+			if ((int8_t)(*iter)->GetPid() == pid) {
+				Client* client = *iter;
+				waiting.erase(iter);
+
+				// Anything held back while loading still goes out, it's just not preceded by this map
+				for (auto& packet : client->StopLoading())
+					client->QueuePacket(packet);
+
+				LOG(LogLevel::kDebug, "Player %s removed from world '%s' while loading", client->GetName().c_str(), m_name.c_str());
+				return;
+			}
+		}
+	}
+
 	auto iter = m_clients.begin();
 	while (iter != m_clients.end()) {
-		if ((*iter)->GetPid() == pid) {
-			m_clients.erase(iter);
+		if ((int8_t)(*iter)->GetPid() == pid) {
 			LOG(LogLevel::kDebug, "Player %s removed from world '%s'", (*iter)->GetName().c_str(), m_name.c_str());
+			m_clients.erase(iter);
 			Protocol::DespawnClient(pid, m_clients);
 			break;
 		}
@@ -147,6 +276,120 @@ void World::RemoveClient(int8_t pid)
 	}
 }
 
+void World::StartMapJob()
+{
+	Server* server = Server::GetInstance();
+	int level = server->GetCompressionController().ChooseLevel(server->GetTickHeadroom(), server->GetNumLoadingClients(), m_map.GetFlatSize());
+
+	// Copies the segments that need compressing, the rest of the map stays where it is
+	auto compression = std::make_shared<Map::CompressionJob>(m_map.StartCompression(level));
+
+	// Written by the worker as well, it only changes when the map does
+	bool writeStream = (GetOption("streamfile") == "true");
+	std::string streamFilename = GetLevelStreamFilename();
+	size_t rawSize = m_map.GetFlatSize();
+	Position size(m_map.GetXSize(), m_map.GetYSize(), m_map.GetZSize());
+
+	m_mapJob.reset(new MapJob());
+	m_mapJob->compression = compression;
+	m_mapJob->done = std::async(std::launch::async, [compression, writeStream, streamFilename, rawSize, size]() {
+		Map::RunCompression(*compression);
+
+		if (writeStream)
+			LevelStream::Write(streamFilename, *compression->result, rawSize, size);
+	});
+
+	Metrics::GetMetrics()->Add("map_jobs", 1);
+
+	LOG(LogLevel::kDebug, "Compressing map for world '%s' in the background", m_name.c_str());
+}
+
+void World::FinishMapJob()
+{
+	std::unique_ptr<MapJob> job = std::move(m_mapJob);
+
+	job->done.get();
+
+	m_map.FinishCompression(*job->compression);
+
+	// A new file may have been written. Only worth checking if it matches the map as it is now, otherwise
+	// OpenLevelStream() would checksum the whole map on the game thread for nothing.
+	if (job->compression->version == m_map.GetVersion())
+		m_levelStreamChecked = false;
+
+	auto compressed = job->compression->result;
+
+	for (auto& client : job->clients)
+		FinishJoin(client, compressed, job->changes);
+}
+
+void World::FinishJoin(Client* client, std::shared_ptr<const std::vector<uint8_t>> compressed, const std::vector<BlockChange>& changes)
+{
+	std::deque<SharedPacket> held = client->StopLoading();
+
+	// Everything after this is held until the last LevelData packet is queued
+	Protocol::SendLevelData(client, compressed);
+	Protocol::SendLevelFinal(client, m_map);
+
+	// The compressed map predates these
+	for (auto& change : changes)
+		Protocol::SendBlock(client, change.pos, change.type);
+
+	Protocol::SpawnClient(client, m_spawnPosition, m_clients);
+	Protocol::SendClientsTo(client, m_clients);
+
+	m_clients.push_back(client);
+
+	for (auto& packet : held)
+		client->QueuePacket(packet);
+}
+
+// Files kept next to the map, named after it
+std::string World::GetMapSideFilename(const std::string& extension)
+{
+	std::string filename = m_map.GetFilename();
+
+	std::size_t pos = filename.rfind(".raw");
+	if (pos != std::string::npos && pos == filename.size() - 4)
+		filename.erase(pos);
+
+	return filename + extension;
+}
+
+// Checks the file against the map again whenever either of them changed
+bool World::OpenLevelStream()
+{
+	if (GetOption("streamfile") != "true" || !m_map.IsLoaded()) {
+		m_levelStream.Close();
+		return false;
+	}
+
+	uint32_t version = m_map.GetVersion();
+
+	if (m_levelStreamChecked && m_levelStreamVersion == version)
+		return m_levelStream.IsOpen();
+
+	m_levelStream.Close();
+
+	// After the first check a matching file can only exist once the current map was compressed, skip checksumming until then
+	if (m_levelStreamChecked && m_map.GetCompressedBuffer() == nullptr)
+		return false;
+
+	Position size(m_map.GetXSize(), m_map.GetYSize(), m_map.GetZSize());
+	m_levelStream.Open(GetLevelStreamFilename(), m_map.GetChecksum(), m_map.GetFlatSize(), size);
+
+	m_levelStreamChecked = true;
+	m_levelStreamVersion = version;
+
+	return m_levelStream.IsOpen();
+}
+
+void World::RecordBlockChange(Position pos, uint8_t type)
+{
+	if (m_mapJob != nullptr)
+		m_mapJob->changes.push_back({ pos, type });
+}
+
 void World::SetActive(bool active)
 {
 	m_active = active;
@@ -189,6 +432,30 @@ bool World::IsValidOption(std::string option)
 
 void World::Tick()
 {
+	if (m_mapJob != nullptr && m_mapJob->done.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+		FinishMapJob();
+
+	if (m_saveJob != nullptr && m_saveJob->done.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+		FinishSaveJob();
+
+	if (m_journal.PollFailure())
+		LOG(LogLevel::kError, "Couldn't write block journal for world '%s'", m_name.c_str());
+
+	// Movement is relayed at a fixed rate no matter how often clients send it
+	// The deadline moves on by the interval rather than from whichever tick got there, so the rate holds
+	// even though ticks don't line up with it
+	sf::Time now = m_positionClock.getElapsedTime();
+	if (now >= m_positionDeadline) {
+		BroadcastPositions();
+
+		sf::Time interval = sf::milliseconds(Server::GetInstance()->GetPositionInterval());
+		m_positionDeadline += interval;
+
+		// No burst of broadcasts to catch up after a stall
+		if (m_positionDeadline < now)
+			m_positionDeadline = now + interval;
+	}
+
 	if (!m_active)
 		return;
 
@@ -202,8 +469,16 @@ void World::Tick()
 
 void World::OnPosition(Client* client, struct Protocol::cposp clientPos)
 {
+	Position pos = client->GetPosition();
+
+	// Clients keep sending their position while standing still
+	if (pos.x == clientPos.pos.x && pos.y == clientPos.pos.y && pos.z == clientPos.pos.z
+		&& client->GetYaw() == clientPos.yaw && client->GetPitch() == clientPos.pitch)
+		return;
+
+	// Only the latest position is kept, BroadcastPositions() sends it on the next interval
 	client->SetPositionOrientation(clientPos.pos, clientPos.yaw, clientPos.pitch);
-	Protocol::SendPlayerPositionUpdate(client, m_clients);
+	client->SetMoved(true);
 }
 
 void World::OnBlock(Client* client, struct Protocol::cblockp clientBlock)
@@ -223,7 +498,7 @@ void World::OnBlock(Client* client, struct Protocol::cblockp clientBlock)
 	}
 
 	try {
-		m_map.SetBlock(clientBlock.pos, type);
+		SetBlock(position, type, client->GetName());
 	} catch(std::runtime_error const& e) {
 		LOG(LogLevel::kWarning, "Exception in LuaPlaceBlock: %s", e.what());
 
@@ -231,25 +506,47 @@ void World::OnBlock(Client* client, struct Protocol::cblockp clientBlock)
 		return;
 	}
 
-	uint8_t pid = client->GetPid();
 	// Broadcast block changes to all other clients
+	Protocol::SendBlock(m_clients, position, type, client);
+	RecordBlockChange(position, type);
+}
+
+void World::SetBlock(Position pos, uint8_t type, const std::string& player)
+{
+	uint8_t oldType = m_map.GetBlockType(pos.x, pos.y, pos.z);
+
+	m_map.SetBlock(pos, type);
+
+	if (oldType == type)
+		return;
+
+	// Generated worlds start a journal with their first change
+	if (!m_journalChecked)
+		OpenJournal(false);
+
+	if (m_journal.IsOpen())
+		m_journal.Append(pos, oldType, type, player);
+
+	m_saveFlag = true;
+}
+
+void World::BroadcastPositions()
+{
 	for (auto& obj : m_clients) {
-		if (obj->GetPid() != pid) {
-			Protocol::SendBlock(obj, position, type);
+		if (obj->HasMoved()) {
+			Protocol::SendPlayerPositionUpdate(obj, m_clients);
+			obj->SetMoved(false);
 		}
 	}
-
-	m_saveFlag = true;
 }
 
 void World::BroadcastMessage(std::string message)
 {
-	for (auto& obj : m_clients)
-		Server::GetInstance()->SendWrappedMessage(obj, "&e[WORLD]: " + message);
+	Server::GetInstance()->SendWrappedMessage(m_clients, "&e[WORLD]: " + message);
 }
 
 void World::SendBlockToClients(uint8_t type, short x, short y, short z)
 {
-	for (auto& obj : m_clients)
-		Protocol::SendBlock(obj, Position(x, y, z), type);
+	Protocol::SendBlock(m_clients, Position(x, y, z), type);
+	RecordBlockChange(Position(x, y, z), type);
 }
@@ -2,19 +2,25 @@
 #define WORLD_H_
 
 #include "Map.hpp"
+#include "BlockJournal.hpp"
 #include "Client.hpp"
 #include "Position.hpp"
 #include "Network/Protocol.hpp"
+#include "Network/LevelStream.hpp"
 
 #include <string>
 #include <vector>
 #include <map>
+#include <memory>
+#include <future>
 
 class World {
 public:
 	World();
 	World(std::string name);
 
+	~World();
+
 	Map& GetMap() { return m_map; }
 	bool GetActive() { return m_active; }
 	Position GetSpawnPosition() { return m_spawnPosition; }
@@ -38,12 +44,28 @@ public:
 
 	void OnPosition(Client* client, struct Protocol::cposp clientPos);
 	void OnBlock(Client* client, struct Protocol::cblockp clientBlock);
+	// Changes the map, journals the change and flags the world for saving; throws like Map::SetBlock
+	void SetBlock(Position pos, uint8_t type, const std::string& player);
 	void BroadcastMessage(std::string message);
+	void BroadcastPositions();
 	void SendBlockToClients(uint8_t type, short x, short y, short z);
 
 private:
 	enum { kAutosaveTime = 300 /* seconds */ };
 
+	struct BlockChange {
+		Position pos;
+		uint8_t type;
+	};
+
+	// Map compression running on a worker thread, joining clients wait in the loading state until it's done
+	struct MapJob {
+		std::shared_ptr<Map::CompressionJob> compression;
+		std::future<void> done;
+		std::vector<Client*> clients;
+		std::vector<BlockChange> changes; // Made after the snapshot, replayed to the waiting clients
+	};
+
 	std::string m_name;
 	Map m_map;
 	Position m_spawnPosition;
@@ -51,10 +73,43 @@ private:
 
 	std::map<std::string, std::string> m_options;
 
+	std::unique_ptr<MapJob> m_mapJob;
+
+	// Map save running on a worker thread, only taking the snapshot happens on the tick
+	struct SaveJob {
+		std::shared_ptr<Map::SaveJob> save;
+		std::future<void> done;
+		uint64_t journalPosition; // Journaled changes the snapshot contains
+	};
+
+	std::unique_ptr<SaveJob> m_saveJob;
+
+	BlockJournal m_journal;
+	bool m_journalChecked;
+
+	LevelStream m_levelStream;
+	bool m_levelStreamChecked;
+	uint32_t m_levelStreamVersion; // Map version the file was last checked against
+
 	sf::Clock m_autosaveClock;
+	sf::Clock m_positionClock;
+	sf::Time m_positionDeadline; // On m_positionClock
 
 	bool m_active;
 	bool m_saveFlag;
+
+	void StartMapJob();
+	void FinishMapJob();
+	void FinishJoin(Client* client, std::shared_ptr<const std::vector<uint8_t>> compressed, const std::vector<BlockChange>& changes);
+	void RecordBlockChange(Position pos, uint8_t type);
+
+	void StartSaveJob();
+	void FinishSaveJob();
+
+	std::string GetMapSideFilename(const std::string& extension);
+	std::string GetLevelStreamFilename() { return GetMapSideFilename(".stream"); }
+	int OpenJournal(bool replay);
+	bool OpenLevelStream();
 };
 
 #endif // WORLD_H_